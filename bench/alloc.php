@@ -0,0 +1,97 @@
+<?php
+/*
+ * Memory and time needed to collect matches, next to json_decode().
+ *
+ *   php -d extension=modules/json_path.so bench/alloc.php [records] [runs]
+ *       [variant]
+ *
+ * "no intern" turns off sharing of repeated short keys and values, to
+ * compare peak memory with and without it.
+ *
+ * Peak memory is reset between variants on PHP 8.2+. Before that the peak
+ * only grows, so pass a variant name to measure one at a time.
+ */
+
+if (!extension_loaded('json_path')) {
+    fwrite(STDERR, "json_path is not loaded\n");
+    exit(1);
+}
+
+$records = isset($argv[1]) ? (int) $argv[1] : 100000;
+$runs = isset($argv[2]) ? (int) $argv[2] : 5;
+
+function document($records)
+{
+    $rows = array();
+    for ($i = 0; $i < $records; $i++) {
+        $rows[] = sprintf('{"id":%d,"name":"user %d","active":%s,' .
+            '"score":%d.5,"tags":["red","green","blue"],"team":"t%d"}',
+            $i, $i, $i % 2 ? 'true' : 'false', $i % 1000, $i % 10);
+    }
+    return '{"meta":{"count":' . $records . '},"rows":[' .
+        implode(',', $rows) . ']}';
+}
+
+$variants = array(
+    'json_decode' => function ($json) {
+        return json_decode($json);
+    },
+    'extract rows' => function ($json) {
+        $jp = new JsonPath();
+        $jp->addPath('rows');
+        return $jp->extract($json);
+    },
+    'extract rows, no intern' => function ($json) {
+        $jp = new JsonPath();
+        $jp->setInternStrings(false);
+        $jp->addPath('rows');
+        return $jp->extract($json);
+    },
+    'extract rows[*].name' => function ($json) {
+        $jp = new JsonPath();
+        $jp->addPath('rows[*].name');
+        return $jp->extract($json);
+    },
+    'callback rows[*]' => function ($json) {
+        $jp = new JsonPath();
+        $jp->addPath('rows[*]');
+        $n = 0;
+        $jp->addCallback(function ($path, $row) use (&$n) {
+            $n++;
+        });
+        $jp->parse($json);
+        return $n;
+    },
+);
+
+if (isset($argv[3])) {
+    if (!isset($variants[$argv[3]])) {
+        fwrite(STDERR, "Unknown variant, one of: " .
+            implode(', ', array_keys($variants)) . "\n");
+        exit(1);
+    }
+    $variants = array($argv[3] => $variants[$argv[3]]);
+}
+
+$json = document($records);
+printf("PHP %s, %d records, %.1f MB of JSON, best of %d runs\n\n",
+    PHP_VERSION, $records, strlen($json) / 1048576, $runs);
+printf("%-24s %12s %14s\n", 'variant', 'time (ms)', 'peak (MB)');
+
+foreach ($variants as $name => $fn) {
+    if (function_exists('memory_reset_peak_usage')) {
+        memory_reset_peak_usage();
+    }
+    $base = memory_get_usage();
+    $best = INF;
+
+    for ($i = 0; $i < $runs; $i++) {
+        $start = microtime(true);
+        $result = $fn($json);
+        $best = min($best, microtime(true) - $start);
+        unset($result);
+    }
+
+    printf("%-24s %12.1f %14.1f\n", $name, $best * 1000,
+        (memory_get_peak_usage() - $base) / 1048576);
+}
@@ -0,0 +1,78 @@
+<?php
+/*
+ * Per-call cost of parsing many small documents, where the fixed cost of
+ * a parse (tokenizer handle, stacks, result array) dominates.
+ *
+ *   php -d extension=modules/json_path.so bench/small_docs.php [calls]
+ *       [runs]
+ *
+ * Run it against builds before and after a change to compare; "reused"
+ * keeps one JsonPath for every call, "new" builds one per call.
+ */
+
+if (!extension_loaded('json_path')) {
+    fwrite(STDERR, "json_path is not loaded\n");
+    exit(1);
+}
+
+$calls = isset($argv[1]) ? (int) $argv[1] : 100000;
+$runs = isset($argv[2]) ? (int) $argv[2] : 5;
+
+/* about 1 KB */
+$items = array();
+for ($i = 0; $i < 12; $i++) {
+    $items[] = sprintf('{"sku":"item-%d","qty":%d,"price":%d.99}', $i, $i,
+        $i * 3);
+}
+$json = '{"id":12345,"customer":{"name":"Jane Doe","email":' .
+    '"jane@example.com"},"status":"shipped","items":[' .
+    implode(',', $items) . '],"notes":"' . str_repeat('x', 200) . '"}';
+
+$variants = array(
+    'json_decode' => function ($json, $calls) {
+        for ($i = 0; $i < $calls; $i++) {
+            $r = json_decode($json);
+        }
+    },
+    'extract, reused' => function ($json, $calls) {
+        $jp = new JsonPath();
+        $jp->addPath('customer.name');
+        $jp->addPath('items[*].qty');
+        for ($i = 0; $i < $calls; $i++) {
+            $r = $jp->extract($json);
+        }
+    },
+    'extract, new' => function ($json, $calls) {
+        for ($i = 0; $i < $calls; $i++) {
+            $jp = new JsonPath();
+            $jp->addPath('customer.name');
+            $jp->addPath('items[*].qty');
+            $r = $jp->extract($json);
+        }
+    },
+    'parse, reused' => function ($json, $calls) {
+        $jp = new JsonPath();
+        $jp->addPath('customer.name');
+        $jp->addCallback(function ($path, $value) {
+        });
+        for ($i = 0; $i < $calls; $i++) {
+            $jp->parse($json);
+        }
+    },
+);
+
+printf("PHP %s, %d bytes per document, %d calls, best of %d runs\n\n",
+    PHP_VERSION, strlen($json), $calls, $runs);
+printf("%-20s %12s\n", 'variant', 'ns per call');
+
+foreach ($variants as $name => $fn) {
+    $best = INF;
+
+    for ($i = 0; $i < $runs; $i++) {
+        $start = microtime(true);
+        $fn($json, $calls);
+        $best = min($best, microtime(true) - $start);
+    }
+
+    printf("%-20s %12.0f\n", $name, $best * 1e9 / $calls);
+}
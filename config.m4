@@ -1,6 +1,12 @@
 PHP_ARG_WITH(json_path, for JSON path support,
 [  --with-json-path[=DIR]       Include JSON path support])
 
+PHP_ARG_WITH(json-path-zlib, for gzip input support in json_path,
+[  --with-json-path-zlib[=DIR]  json_path: Decompress gzip input], yes, no)
+
+PHP_ARG_WITH(json-path-zstd, for zstd input support in json_path,
+[  --with-json-path-zstd[=DIR]  json_path: Decompress zstd input], yes, no)
+
 if test "$PHP_JSON_PATH" != "no"; then
   if test -r $PHP_JSON_PATH/include/yajl/yajl_parse.h; then
     YAJL_DIR=$PHP_JSON_PATH
@@ -27,6 +33,46 @@ if test "$PHP_JSON_PATH" != "no"; then
   PHP_ADD_INCLUDE($YAJL_DIR/include)
   PHP_ADD_LIBRARY_WITH_PATH(yajl, $YAJL_DIR/lib, JSON_PATH_SHARED_LIBADD)
 
+  if test "$PHP_JSON_PATH_ZLIB" != "no"; then
+    for i in $PHP_JSON_PATH_ZLIB /usr/local /usr; do
+      if test -r $i/include/zlib.h; then
+        JSON_PATH_ZLIB_DIR=$i
+        break
+      fi
+    done
+
+    if test -n "$JSON_PATH_ZLIB_DIR"; then
+      PHP_ADD_INCLUDE($JSON_PATH_ZLIB_DIR/include)
+      PHP_ADD_LIBRARY_WITH_PATH(z, $JSON_PATH_ZLIB_DIR/lib, JSON_PATH_SHARED_LIBADD)
+      AC_DEFINE([HAVE_JSON_PATH_ZLIB], 1, [whether json_path can read gzip input])
+    else
+      AC_MSG_WARN([zlib.h not found, gzip input support disabled])
+    fi
+  fi
+
+  if test "$PHP_JSON_PATH_ZSTD" != "no"; then
+    for i in $PHP_JSON_PATH_ZSTD /usr/local /usr; do
+      if test -r $i/include/zstd.h; then
+        JSON_PATH_ZSTD_DIR=$i
+        break
+      fi
+    done
+
+    if test -n "$JSON_PATH_ZSTD_DIR"; then
+      PHP_ADD_INCLUDE($JSON_PATH_ZSTD_DIR/include)
+      PHP_ADD_LIBRARY_WITH_PATH(zstd, $JSON_PATH_ZSTD_DIR/lib, JSON_PATH_SHARED_LIBADD)
+      AC_DEFINE([HAVE_JSON_PATH_ZSTD], 1, [whether json_path can read zstd input])
+    else
+      AC_MSG_WARN([zstd.h not found, zstd input support disabled])
+    fi
+  fi
+
+  AC_CHECK_HEADER([pthread.h], [
+    PHP_ADD_LIBRARY(pthread, 1, JSON_PATH_SHARED_LIBADD)
+    AC_DEFINE([HAVE_JSON_PATH_THREADS], 1, [whether json_path can use a read-ahead thread])
+  ])
+
   PHP_NEW_EXTENSION(json_path, json_path.c, $ext_shared)
+  PHP_ADD_EXTENSION_DEP(json_path, json)
   PHP_SUBST(JSON_PATH_SHARED_LIBADD)
 fi
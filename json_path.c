@@ -4,11 +4,35 @@
 
 #include <yajl/yajl_parse.h>
 
+#ifdef HAVE_JSON_PATH_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_JSON_PATH_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef HAVE_JSON_PATH_THREADS
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+#include <time.h>
+
 #include "php.h"
 #include "php_ini.h"
 #include "ext/standard/info.h"
+#include "zend_smart_str.h"
+#include "ext/json/php_json.h"
 #include "php_json_path.h"
 
+#if PHP_VERSION_ID < 70000
+# error "json_path requires PHP 7.0 or later"
+#endif
+
 static PHP_MINFO_FUNCTION(json_path);
 
 ZEND_DECLARE_MODULE_GLOBALS(json_path)
@@ -29,11 +53,8 @@ typedef struct json_path_component {
     json_path_component_type type;
     char wildcard;
     union {
-        struct {
-            char *key;
-            int key_len;
-        };
-        int index;
+        zend_string *key;
+        zend_long index;
     };
 } json_path_component;
 
@@ -45,11 +66,8 @@ typedef enum json_path_type {
 typedef struct json_path_stack_elem {
     json_path_type type;
     union {
-        struct {
-            char *key;
-            int key_len;
-        };
-        int index;
+        zend_string *key;
+        zend_long index;
     };
 } json_path_stack_elem;
 
@@ -58,35 +76,309 @@ typedef enum json_path_match_status {
     STATUS_COLLECTING,
 } json_path_match_status;
 
+/* aggregate() operations */
+#define JSON_PATH_AGGREGATE_COUNT 1
+#define JSON_PATH_AGGREGATE_SUM 2
+#define JSON_PATH_AGGREGATE_MIN 3
+#define JSON_PATH_AGGREGATE_MAX 4
+#define JSON_PATH_AGGREGATE_AVG 5
+#define JSON_PATH_AGGREGATE_DISTINCT 6
+
+/* HyperLogLog with 2^14 one-byte registers: about 0.8% standard error */
+#define JSON_PATH_HLL_BITS 14
+#define JSON_PATH_HLL_REGISTERS (1 << JSON_PATH_HLL_BITS)
+
+typedef struct json_path_number {
+    int is_double;
+    zend_long l;
+    double d;
+} json_path_number;
+
+/* Running state of an aggregate path. Matches are folded in as the
+ * tokenizer reports them; depth skips over matched containers. */
+typedef struct json_path_aggregate {
+    zend_long op;
+    int depth;
+    zend_long count;
+    json_path_number sum;
+    json_path_number min;
+    json_path_number max;
+    unsigned char *registers;
+} json_path_aggregate;
+
 typedef struct json_path {
     simple_vector components;
     json_path_match_status status;
-    char *name;
-    int name_len;
+    zend_string *name;
+    int wildcard;
     simple_vector collection_stack;
+    json_path_aggregate *aggregate;
+    zend_class_entry *ce;
+    HashTable *class_map;
+    int skip_depth;
 } json_path;
 
+/* The callable is resolved once in addCallback(); every match afterwards
+ * goes straight through the cached fcall info. */
+typedef struct json_path_callback {
+    zend_fcall_info fci;
+    zend_fcall_info_cache fcc;
+} json_path_callback;
+
+/* Strings seen during one parse, so repeated short keys and enum-like
+ * values share a single refcounted zend_string. Open addressing on the
+ * string hash; once the table is 3/4 full it only serves lookups. */
+#define JSON_PATH_INTERN_SLOTS 4096
+#define JSON_PATH_INTERN_MAX_LEN 32
+
+typedef struct json_path_intern_table {
+    zend_string **slots;
+    uint16_t *filled;
+    int used;
+    zend_bool enabled;
+} json_path_intern_table;
+
+/* Initial depth of path_stack and collection stacks, deep enough that
+ * typical documents never grow them */
+#define JSON_PATH_STACK_SIZE 32
+
+#define JSON_PATH_READ_BUFFER_SIZE (64 * 1024)
+#define JSON_PATH_DECODE_BUFFER_SIZE (256 * 1024)
+
+typedef enum json_path_encoding {
+    ENCODING_DETECT,
+    ENCODING_NONE,
+    ENCODING_GZIP,
+    ENCODING_ZSTD
+} json_path_encoding;
+
+typedef int (*json_path_sink)(void *ctx, const unsigned char *buf, size_t len);
+
+typedef struct json_path_decoder {
+    json_path_encoding encoding;
+    unsigned char magic[4];
+    size_t magic_len;
+#ifdef HAVE_JSON_PATH_ZLIB
+    z_stream zs;
+#endif
+#ifdef HAVE_JSON_PATH_ZSTD
+    ZSTD_DStream *zds;
+#endif
+    unsigned char *out;
+    size_t out_size;
+    size_t out_limit;
+    size_t emitted;
+    const unsigned char *rest;
+    size_t rest_len;
+    int paused;
+    int finished;
+    const char *error;
+    json_path_sink sink;
+    void *sink_ctx;
+} json_path_decoder;
+
+#ifdef HAVE_JSON_PATH_THREADS
+#define JSON_PATH_READ_AHEAD_BUFFERS 4
+#define JSON_PATH_READ_AHEAD_BUFFER_SIZE (1024 * 1024)
+
+typedef struct json_path_read_ahead {
+    int fd;
+    pthread_t thread;
+    int started;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned char *bufs[JSON_PATH_READ_AHEAD_BUFFERS];
+    size_t lens[JSON_PATH_READ_AHEAD_BUFFERS];
+    int head;
+    int count;
+    int done;
+    int cancel;
+    int eof;
+    const char *error;
+    unsigned char *prefix;
+    size_t prefix_len;
+    unsigned char *fill;
+    size_t fill_len;
+    json_path_decoder decoder;
+} json_path_read_ahead;
+#endif
+
+/* transform() modes */
+#define JSON_PATH_TRANSFORM_REMOVE 1
+#define JSON_PATH_TRANSFORM_REPLACE 2
+#define JSON_PATH_TRANSFORM_CALLBACK 3
+
+#define JSON_PATH_NO_OFFSET ((uint64_t) -1)
+
+/* transform() keeps the input bytes that have not been copied to the
+ * output or dropped yet. Offsets are absolute positions in the tokenized
+ * input; pending holds [pending_off, input_off). */
+typedef struct json_path_transform {
+    php_stream *out;
+    zend_long mode;
+    smart_str replacement;
+    json_path_callback callback;
+    smart_str out_buf;
+    unsigned char *pending;
+    size_t pending_head;
+    size_t pending_len;
+    size_t pending_size;
+    uint64_t pending_off;
+    uint64_t input_off;
+    uint64_t chunk_off;
+    uint64_t last_token_end;
+    json_path *active;
+    int replace_pending;
+    int skip_comma_depth;
+    int failed;
+} json_path_transform;
+
+#define JSON_PATH_PROFILE_NULL (1 << 0)
+#define JSON_PATH_PROFILE_BOOLEAN (1 << 1)
+#define JSON_PATH_PROFILE_INTEGER (1 << 2)
+#define JSON_PATH_PROFILE_FLOAT (1 << 3)
+#define JSON_PATH_PROFILE_STRING (1 << 4)
+#define JSON_PATH_PROFILE_OBJECT (1 << 5)
+#define JSON_PATH_PROFILE_ARRAY (1 << 6)
+
+#define JSON_PATH_PROFILE_MAX_PATHS 10000
+
+static const char *json_path_profile_type_names[] = {
+    "null", "boolean", "integer", "float", "string", "object", "array"
+};
+
+/* Sizes are string lengths in bytes and member/element counts; other
+ * values have none. max_size is -1 until a sized value is seen. */
+typedef struct json_path_profile_entry {
+    zend_long count;
+    int types;
+    zend_long min_size;
+    zend_long max_size;
+} json_path_profile_entry;
+
+typedef struct json_path_profile_frame {
+    size_t base;
+    int is_array;
+    zend_long size;
+    json_path_profile_entry *entry;
+    json_path_profile_entry *elements;
+} json_path_profile_frame;
+
+typedef struct json_path_profile {
+    HashTable entries;
+    smart_str path;
+    simple_vector frames;
+    int truncated;
+} json_path_profile;
+
+/* Upper bound for setParallelism() */
+#define JSON_PATH_MAX_PARALLELISM 64
+
+#define JSON_PATH_FORMAT_JSON 1
+#define JSON_PATH_FORMAT_CBOR 2
+#define JSON_PATH_FORMAT_MSGPACK 3
+
+typedef struct json_path_binary_frame {
+    int is_map;
+    int expect_key;
+    int64_t remaining;
+} json_path_binary_frame;
+
+/* State of the CBOR/MessagePack decoder for one document */
+typedef struct json_path_binary {
+    simple_vector frames;
+    smart_str carry;
+    size_t need;
+    smart_str chunks;
+    int chunks_major;
+    int done;
+    const char *error;
+} json_path_binary;
+
+/* parseFor() feeds the input in slices this large and checks the clock
+ * between them. Compressed slices are also cut short once they have
+ * inflated to JSON_PATH_SLICE_OUTPUT_SIZE. */
+#define JSON_PATH_SLICE_SIZE (16 * 1024)
+#define JSON_PATH_SLICE_OUTPUT_SIZE (64 * 1024)
+
+#define JSON_PATH_PARSE_COMPLETE 1
+#define JSON_PATH_PARSE_INCOMPLETE 2
+
+/* A parseFor() run that has not reached the end of its input yet. The
+ * tokenizer, decoder and matching state stay on the object in between. */
+typedef struct json_path_session {
+    int active;
+    zval input;
+    size_t offset;
+    unsigned char *buf;
+} json_path_session;
+
 typedef struct json_path_object {
-    zend_object zo;
     simple_vector paths;
     simple_vector path_stack;
     simple_vector callbacks;
     int objects_as_arrays;
+    int read_ahead;
+    int parallelism;
+    int in_parse;
+    int format;
+    zval *results;
+    json_path_transform *transform;
+    json_path_profile *profile;
+    json_path_intern_table strings;
+    yajl_handle yh;
+    yajl_handle pool;
+    int base_depth;
+    int values;
+    json_path_decoder decoder;
+    json_path_binary binary;
+    json_path_session session;
+    zend_object zo;
 } json_path_object;
 
 static zend_class_entry *json_path_object_ce;
 static zend_object_handlers json_path_object_handlers;
 
+static inline json_path_object *json_path_object_from_obj(zend_object *obj)
+{
+    return (json_path_object *) ((char *) obj -
+        XtOffsetOf(json_path_object, zo));
+}
+
+#define Z_JSON_PATH_P(zv) json_path_object_from_obj(Z_OBJ_P(zv))
+
 PHP_METHOD(JsonPath, addPath);
+PHP_METHOD(JsonPath, aggregate);
 PHP_METHOD(JsonPath, getPaths);
 PHP_METHOD(JsonPath, addCallback);
 PHP_METHOD(JsonPath, getCallbacks);
 PHP_METHOD(JsonPath, setObjectsAsArrays);
 PHP_METHOD(JsonPath, getObjectsAsArrays);
+PHP_METHOD(JsonPath, setReadAhead);
+PHP_METHOD(JsonPath, getReadAhead);
+PHP_METHOD(JsonPath, setParallelism);
+PHP_METHOD(JsonPath, getParallelism);
+PHP_METHOD(JsonPath, setInputFormat);
+PHP_METHOD(JsonPath, getInputFormat);
+PHP_METHOD(JsonPath, setInternStrings);
+PHP_METHOD(JsonPath, getInternStrings);
 PHP_METHOD(JsonPath, parse);
+PHP_METHOD(JsonPath, parseFor);
+PHP_METHOD(JsonPath, extract);
+PHP_METHOD(JsonPath, buildIndex);
+PHP_METHOD(JsonPath, tape);
+PHP_METHOD(JsonPath, transform);
+PHP_METHOD(JsonPath, profile);
 
 ZEND_BEGIN_ARG_INFO_EX(args_for_JsonPath_addPath, 0, 0, 1)
     ZEND_ARG_INFO(0, path)
+    ZEND_ARG_INFO(0, className)
+    ZEND_ARG_INFO(0, classMap)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(args_for_JsonPath_aggregate, 0, 0, 2)
+    ZEND_ARG_INFO(0, path)
+    ZEND_ARG_INFO(0, op)
 ZEND_END_ARG_INFO()
 
 ZEND_BEGIN_ARG_INFO_EX(args_for_JsonPath_getPaths, 0, 0, 0)
@@ -106,29 +398,110 @@ ZEND_END_ARG_INFO()
 ZEND_BEGIN_ARG_INFO_EX(args_for_JsonPath_getObjectsAsArrays, 0, 0, 0)
 ZEND_END_ARG_INFO()
 
+ZEND_BEGIN_ARG_INFO_EX(args_for_JsonPath_setReadAhead, 0, 0, 1)
+    ZEND_ARG_INFO(0, enable)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(args_for_JsonPath_getReadAhead, 0, 0, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(args_for_JsonPath_setParallelism, 0, 0, 1)
+    ZEND_ARG_INFO(0, threads)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(args_for_JsonPath_getParallelism, 0, 0, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(args_for_JsonPath_setInputFormat, 0, 0, 1)
+    ZEND_ARG_INFO(0, format)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(args_for_JsonPath_getInputFormat, 0, 0, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(args_for_JsonPath_setInternStrings, 0, 0, 1)
+    ZEND_ARG_INFO(0, enable)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(args_for_JsonPath_getInternStrings, 0, 0, 0)
+ZEND_END_ARG_INFO()
+
 ZEND_BEGIN_ARG_INFO_EX(args_for_JsonPath_parse, 0, 0, 1)
     ZEND_ARG_INFO(0, s)
+    ZEND_ARG_INFO(0, index_file)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(args_for_JsonPath_parseFor, 0, 0, 2)
+    ZEND_ARG_INFO(0, s)
+    ZEND_ARG_INFO(0, microseconds)
 ZEND_END_ARG_INFO()
 
-static zend_function_entry json_path_object_fe[] = {
+ZEND_BEGIN_ARG_INFO_EX(args_for_JsonPath_extract, 0, 0, 1)
+    ZEND_ARG_INFO(0, s)
+    ZEND_ARG_INFO(0, index_file)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(args_for_JsonPath_buildIndex, 0, 0, 2)
+    ZEND_ARG_INFO(0, file)
+    ZEND_ARG_INFO(0, index_file)
+    ZEND_ARG_INFO(0, depth)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(args_for_JsonPath_tape, 0, 0, 1)
+    ZEND_ARG_INFO(0, s)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(args_for_JsonPath_transform, 0, 0, 3)
+    ZEND_ARG_INFO(0, s)
+    ZEND_ARG_INFO(0, output)
+    ZEND_ARG_INFO(0, mode)
+    ZEND_ARG_INFO(0, replacement)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(args_for_JsonPath_profile, 0, 0, 1)
+    ZEND_ARG_INFO(0, s)
+ZEND_END_ARG_INFO()
+
+static const zend_function_entry json_path_object_fe[] = {
     PHP_ME(JsonPath, addPath, args_for_JsonPath_addPath, ZEND_ACC_PUBLIC)
+    PHP_ME(JsonPath, aggregate, args_for_JsonPath_aggregate, ZEND_ACC_PUBLIC)
     PHP_ME(JsonPath, getPaths, args_for_JsonPath_getPaths, ZEND_ACC_PUBLIC)
     PHP_ME(JsonPath, addCallback, args_for_JsonPath_addCallback, ZEND_ACC_PUBLIC)
     PHP_ME(JsonPath, getCallbacks, args_for_JsonPath_getCallbacks, ZEND_ACC_PUBLIC)
     PHP_ME(JsonPath, setObjectsAsArrays, args_for_JsonPath_setObjectsAsArrays, ZEND_ACC_PUBLIC)
     PHP_ME(JsonPath, getObjectsAsArrays, args_for_JsonPath_getObjectsAsArrays, ZEND_ACC_PUBLIC)
+    PHP_ME(JsonPath, setReadAhead, args_for_JsonPath_setReadAhead, ZEND_ACC_PUBLIC)
+    PHP_ME(JsonPath, getReadAhead, args_for_JsonPath_getReadAhead, ZEND_ACC_PUBLIC)
+    PHP_ME(JsonPath, setParallelism, args_for_JsonPath_setParallelism, ZEND_ACC_PUBLIC)
+    PHP_ME(JsonPath, getParallelism, args_for_JsonPath_getParallelism, ZEND_ACC_PUBLIC)
+    PHP_ME(JsonPath, setInputFormat, args_for_JsonPath_setInputFormat, ZEND_ACC_PUBLIC)
+    PHP_ME(JsonPath, getInputFormat, args_for_JsonPath_getInputFormat, ZEND_ACC_PUBLIC)
+    PHP_ME(JsonPath, setInternStrings, args_for_JsonPath_setInternStrings, ZEND_ACC_PUBLIC)
+    PHP_ME(JsonPath, getInternStrings, args_for_JsonPath_getInternStrings, ZEND_ACC_PUBLIC)
     PHP_ME(JsonPath, parse, args_for_JsonPath_parse, ZEND_ACC_PUBLIC)
-    { NULL, NULL, NULL }
+    PHP_ME(JsonPath, parseFor, args_for_JsonPath_parseFor, ZEND_ACC_PUBLIC)
+    PHP_ME(JsonPath, extract, args_for_JsonPath_extract, ZEND_ACC_PUBLIC)
+    PHP_ME(JsonPath, buildIndex, args_for_JsonPath_buildIndex, ZEND_ACC_PUBLIC | ZEND_ACC_STATIC)
+    PHP_ME(JsonPath, tape, args_for_JsonPath_tape, ZEND_ACC_PUBLIC | ZEND_ACC_STATIC)
+    PHP_ME(JsonPath, transform, args_for_JsonPath_transform, ZEND_ACC_PUBLIC)
+    PHP_ME(JsonPath, profile, args_for_JsonPath_profile, ZEND_ACC_PUBLIC)
+    PHP_FE_END
 };
 
-static inline void simple_vector_init(simple_vector *v, size_t elem_size)
+static inline void simple_vector_init_size(simple_vector *v, size_t elem_size,
+    int num_allocd)
 {
     v->elem_size = elem_size;
-    v->num_allocd = 5;
+    v->num_allocd = num_allocd;
     v->elems = emalloc(v->elem_size * v->num_allocd);
     v->len = 0;
 }
 
+static inline void simple_vector_init(simple_vector *v, size_t elem_size)
+{
+    simple_vector_init_size(v, elem_size, 5);
+}
+
 static inline void simple_vector_free(simple_vector *v)
 {
     efree(v->elems);
@@ -159,55 +532,70 @@ static inline void json_path_free(json_path *path)
 {
     int i;
 
-    efree(path->name);
+    zend_string_release(path->name);
 
     for (i=0; i < path->components.len; i++) {
-        json_path_component *c = simple_vector_get(&path->components, 
+        json_path_component *c = simple_vector_get(&path->components,
             json_path_component, i);
-        if (c->type == COMPONENT_MAP_KEY) {
-            efree(c->key);
+        if (c->type == COMPONENT_MAP_KEY && c->key) {
+            zend_string_release(c->key);
+        }
+    }
+
+    for (i=0; i < path->collection_stack.len; i++) {
+        zval_ptr_dtor(simple_vector_get(&path->collection_stack, zval, i));
+    }
+
+    if (path->class_map) {
+        zend_hash_destroy(path->class_map);
+        FREE_HASHTABLE(path->class_map);
+    }
+
+    if (path->aggregate) {
+        if (path->aggregate->registers) {
+            efree(path->aggregate->registers);
         }
+        efree(path->aggregate);
     }
 
     simple_vector_free(&path->components);
     simple_vector_free(&path->collection_stack);
 }
 
-static int json_path_parse_next(json_path *path, int head)
+static size_t json_path_parse_next(json_path *path, size_t head)
 {
+    const char *name = ZSTR_VAL(path->name);
+    size_t name_len = ZSTR_LEN(path->name);
     json_path_component c;
-    int tail;
-    char *tmp;
+    size_t tail;
 
-    if (path->name[head] == '[') {
+    if (name[head] == '[') {
         head++;
         tail = head;
-        while (tail < path->name_len && path->name[tail] != ']') { tail++; }
+        while (tail < name_len && name[tail] != ']') { tail++; }
         c.type = COMPONENT_ARRAY_KEY;
-        if ((tail-head) == 1 && path->name[head] == '*') {
+        if ((tail-head) == 1 && name[head] == '*') {
             c.wildcard = 1;
             c.index = 0;
+            path->wildcard = 1;
         } else {
             c.wildcard = 0;
-            tmp = estrndup(path->name+head, (tail-head));
-            c.index = atoi(tmp);
-            efree(tmp);
+            c.index = ZEND_STRTOL(name+head, NULL, 10);
         }
-        if (tail < path->name_len) { tail++; }
+        if (tail < name_len) { tail++; }
     } else {
-        if (path->name[head] == '.') { head++; }
+        if (name[head] == '.') { head++; }
         tail = head;
-        while (tail < path->name_len && path->name[tail] != '.' && 
-            path->name[tail] != '[') { tail++; }
+        while (tail < name_len && name[tail] != '.' &&
+            name[tail] != '[') { tail++; }
         c.type = COMPONENT_MAP_KEY;
-        if ((tail-head) == 1 && path->name[head] == '*') {
+        if ((tail-head) == 1 && name[head] == '*') {
             c.wildcard = 1;
             c.key = NULL;
-            c.key_len = 0;
+            path->wildcard = 1;
         } else {
             c.wildcard = 0;
-            c.key = estrndup(path->name+head, (tail-head));
-            c.key_len = (tail-head);
+            c.key = zend_string_init(name+head, (tail-head), 0);
         }
     }
     simple_vector_append(&path->components, &c);
@@ -216,9 +604,9 @@ static int json_path_parse_next(json_path *path, int head)
 
 static int json_path_parse(json_path *path)
 {
-    int i = 0;
+    size_t i = 0;
 
-    while (i < path->name_len) {
+    while (i < ZSTR_LEN(path->name)) {
         i = json_path_parse_next(path, i);
     }
 
@@ -236,27 +624,92 @@ static inline void json_path_vector_free(simple_vector *paths)
     simple_vector_free(paths);
 }
 
-static inline void json_path_stack_free(simple_vector *path_stack)
+
+/* Returns a new reference to the shared copy of val, creating it if
+ * needed. The stored hash is the one the engine would compute, so later
+ * hashtable inserts with the string as a key do not rehash it. Long
+ * strings are rarely repeated and are copied without a lookup. */
+static zend_string *json_path_intern(json_path_intern_table *table,
+    const char *val, size_t val_len)
+{
+    zend_ulong h;
+    size_t mask = JSON_PATH_INTERN_SLOTS - 1;
+    size_t slot;
+    zend_string *s;
+
+    if (!table->enabled || val_len > JSON_PATH_INTERN_MAX_LEN) {
+        return zend_string_init(val, val_len, 0);
+    }
+
+    h = zend_inline_hash_func(val, val_len);
+    slot = h & mask;
+
+    if (!table->slots) {
+        table->slots = ecalloc(JSON_PATH_INTERN_SLOTS, sizeof(zend_string *));
+        table->filled = emalloc(JSON_PATH_INTERN_SLOTS / 4 * 3 *
+            sizeof(uint16_t));
+    }
+
+    while ((s = table->slots[slot]) != NULL) {
+        if (ZSTR_H(s) == h && ZSTR_LEN(s) == val_len &&
+            memcmp(ZSTR_VAL(s), val, val_len) == 0) {
+            return zend_string_copy(s);
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    s = zend_string_init(val, val_len, 0);
+    ZSTR_H(s) = h;
+
+    if (table->used < JSON_PATH_INTERN_SLOTS / 4 * 3) {
+        table->slots[slot] = zend_string_copy(s);
+        table->filled[table->used++] = (uint16_t) slot;
+    }
+
+    return s;
+}
+
+/* Only visits the slots that were filled, which keeps the per-parse cost
+ * proportional to the document rather than to the table size */
+static void json_path_intern_clear(json_path_intern_table *table)
+{
+    int i;
+
+    for (i=0; i < table->used; i++) {
+        zend_string_release(table->slots[table->filled[i]]);
+        table->slots[table->filled[i]] = NULL;
+    }
+
+    table->used = 0;
+}
+
+static void json_path_stack_clear(simple_vector *path_stack)
 {
     int i;
 
     for (i=0; i < path_stack->len; i++) {
-        json_path_stack_elem *elem = simple_vector_get(path_stack, 
+        json_path_stack_elem *elem = simple_vector_get(path_stack,
             json_path_stack_elem, i);
-        if (elem->type == TYPE_OBJECT) {
-            efree(elem->key);
+        if (elem->type == TYPE_OBJECT && elem->key) {
+            zend_string_release(elem->key);
         }
     }
 
+    path_stack->len = 0;
+}
+
+static inline void json_path_stack_free(simple_vector *path_stack)
+{
+    json_path_stack_clear(path_stack);
     simple_vector_free(path_stack);
 }
 
 static inline int json_path_check_match(json_path_component *c, json_path_stack_elem *e)
 {
-    return (c->type == COMPONENT_ARRAY_KEY && e->type == TYPE_ARRAY 
-        && (c->wildcard || e->index == c->index)) || 
-        (c->type == COMPONENT_MAP_KEY && e->type == TYPE_OBJECT && 
-        (c->wildcard || strcmp(e->key, c->key) == 0));
+    return (c->type == COMPONENT_ARRAY_KEY && e->type == TYPE_ARRAY
+        && (c->wildcard || e->index == c->index)) ||
+        (c->type == COMPONENT_MAP_KEY && e->type == TYPE_OBJECT &&
+        (c->wildcard || zend_string_equals(e->key, c->key)));
 }
 
 static void json_path_check_for_matches(json_path_object *intern)
@@ -300,689 +753,5658 @@ static void json_path_check_for_array_matches(json_path_object *intern)
     }
 }
 
-static void json_path_append_zval(json_path_object *intern, json_path *path, zval *zv)
+/* Stores zv as a property of a collected object. Empty keys are kept as
+ * an empty property name, as json_decode() does since PHP 7.1; 7.0 still
+ * maps them to "_empty_". The property table takes its own reference. */
+static void json_path_write_property(zval *object, zend_string *key, zval *zv)
 {
-    if (path->collection_stack.len > 0) {
-        json_path_stack_elem *stack_elem = simple_vector_get_last(
-            &intern->path_stack, json_path_stack_elem);
-        zval *outer_zv = *simple_vector_get_last(
-            &path->collection_stack, zval *);
+    zend_string *name;
 
-        zval_add_ref(&zv);
+#if PHP_VERSION_ID < 70100
+    if (ZSTR_LEN(key) == 0) {
+        name = zend_string_init("_empty_", sizeof("_empty_")-1, 0);
+    } else {
+        name = zend_string_copy(key);
+    }
+#else
+    name = zend_string_copy(key);
+#endif
 
-        if (stack_elem->type == TYPE_ARRAY) {
-            add_next_index_zval(outer_zv, zv);
-        } else {
-            if (intern->objects_as_arrays) {
-                add_assoc_zval_ex(outer_zv, stack_elem->key,
-                    stack_elem->key_len+1, zv);
-            } else {
-                add_property_zval_ex(outer_zv, 
-                    (stack_elem->key_len ? stack_elem->key : "_empty_"),
-                    (stack_elem->key_len ? stack_elem->key_len+1 : sizeof("_empty_")),
-                    zv);
-                Z_DELREF_P(zv);
-            }
-        }
+#if PHP_VERSION_ID >= 80000
+    zend_std_write_property(Z_OBJ_P(object), name, zv, NULL);
+#else
+    {
+        zval member;
+
+        ZVAL_STR(&member, name);
+        zend_std_write_property(object, &member, zv, NULL);
     }
+#endif
+
+    zend_string_release(name);
+    zval_ptr_dtor(zv);
 }
 
-static void json_path_collected_zval(json_path_object *intern, json_path *path, zval *zv)
+/* Stores zv straight into the slot of a declared property of a hydrated
+ * object, coerced to the property type if it has one. Keys that are not
+ * declared properties are dropped. Consumes zv. */
+static void json_path_hydrate_property(zval *object, zend_string *key, zval *zv)
 {
-    if (path->collection_stack.len == 0) {
-        zval *path_zv;
-        zval *retval = NULL, **argv[2];
-        int i;
-
-        for (i=0; i < intern->callbacks.len; i++) {
-            zval *curr_callback = *simple_vector_get(&intern->callbacks,
-                zval *, i);
+    zend_object *obj = Z_OBJ_P(object);
+    zend_property_info *info;
+    zval *slot;
 
-            MAKE_STD_ZVAL(path_zv);
-            ZVAL_STRINGL(path_zv, path->name, path->name_len, 1);
+    info = zend_hash_find_ptr(&obj->ce->properties_info, key);
 
-            argv[0] = &path_zv;
-            argv[1] = &zv;
-
-            if (SUCCESS == call_user_function_ex(EG(function_table),
-                NULL, curr_callback, &retval, 2, argv, 0, NULL TSRMLS_CC)) {
-            } else {
-                if (!EG(exception)) {
-                    php_error_docref(NULL TSRMLS_CC, E_WARNING, 
-                        "Failed to call callback");
-                }
-            }
+    if (!info || (info->flags & ZEND_ACC_STATIC)
+#ifdef ZEND_ACC_VIRTUAL
+        || (info->flags & ZEND_ACC_VIRTUAL)
+#endif
+        ) {
+        zval_ptr_dtor(zv);
+        return;
+    }
 
-            zval_ptr_dtor(&retval);
-            zval_ptr_dtor(&path_zv);
-        }
-    } else {
-        json_path_append_zval(intern, path, zv);
+#if PHP_VERSION_ID >= 70400
+    if (ZEND_TYPE_IS_SET(info->type) && !zend_verify_property_type(info, zv,
+        0)) {
+        zval_ptr_dtor(zv);
+        return;
     }
+#endif
+
+    slot = OBJ_PROP(obj, info->offset);
+    zval_ptr_dtor(slot);
+    ZVAL_COPY_VALUE(slot, zv);
+#ifdef IS_PROP_UNINIT
+    Z_PROP_FLAG_P(slot) &= ~IS_PROP_UNINIT;
+#endif
 }
 
-static void json_path_object_free_storage(void *object TSRMLS_DC)
+/* Class to hydrate the object starting at the current position into, if
+ * any: the path's own class for the match itself, otherwise whatever the
+ * class map has for the position relative to the match, with array
+ * indexes written as [*]. */
+static zend_class_entry *json_path_class_for(json_path_object *intern,
+    json_path *path)
 {
-    json_path_object *intern = (json_path_object *) object;
+    zend_class_entry *ce = NULL;
+    smart_str rel = {0};
     int i;
 
-    if (!intern) {
-        return;
+    if (path->collection_stack.len == 0) {
+        return path->ce;
     }
 
-    json_path_vector_free(&intern->paths);
-    json_path_stack_free(&intern->path_stack);
+    if (!path->class_map) {
+        return NULL;
+    }
 
-    for (i=0; i < intern->callbacks.len; i++) {
-        zval **curr_zval = simple_vector_get(&intern->callbacks, zval *, i);
-        zval_ptr_dtor(curr_zval);
+    for (i=path->components.len; i < intern->path_stack.len; i++) {
+        json_path_stack_elem *elem = simple_vector_get(&intern->path_stack,
+            json_path_stack_elem, i);
+
+        if (elem->type == TYPE_ARRAY) {
+            smart_str_appendl(&rel, "[*]", sizeof("[*]")-1);
+        } else {
+            if (rel.s) {
+                smart_str_appendc(&rel, '.');
+            }
+            smart_str_append(&rel, elem->key);
+        }
+    }
+
+    if (rel.s) {
+        smart_str_0(&rel);
+        ce = zend_hash_find_ptr(path->class_map, rel.s);
+        smart_str_free(&rel);
     }
 
-    zend_object_std_dtor(&intern->zo TSRMLS_CC);
+    return ce;
+}
 
-    efree(intern);
+/* Consumes zv: ownership moves into the enclosing collected array/object. */
+static void json_path_append_zval(json_path_object *intern, json_path *path,
+    zval *zv)
+{
+    json_path_stack_elem *stack_elem = simple_vector_get_last(
+        &intern->path_stack, json_path_stack_elem);
+    zval *outer_zv = simple_vector_get_last(&path->collection_stack, zval);
+
+    if (stack_elem->type == TYPE_ARRAY) {
+        add_next_index_zval(outer_zv, zv);
+    } else if (Z_TYPE_P(outer_zv) == IS_ARRAY) {
+        zend_symtable_update(Z_ARRVAL_P(outer_zv), stack_elem->key, zv);
+    } else if (Z_OBJCE_P(outer_zv) != zend_standard_class_def) {
+        json_path_hydrate_property(outer_zv, stack_elem->key, zv);
+    } else {
+        json_path_write_property(outer_zv, stack_elem->key, zv);
+    }
 }
 
-static zend_object_value json_path_object_new(zend_class_entry *class_type TSRMLS_DC)
+/* Stores a match in the extract() result array. Wildcard paths were seeded
+ * with an empty array, so their matches are appended in document order;
+ * any other path maps straight to its (last) matched value. */
+static void json_path_add_result(json_path_object *intern, json_path *path,
+    zval *zv)
 {
-    zend_object_value retval;
-    json_path_object *intern;
-    zval *tmp;
+    zval *matches;
 
-    intern = emalloc(sizeof(json_path_object));
-    memset(&intern->zo, 0, sizeof(zend_object));
+    if (path->wildcard && (matches = zend_symtable_find(
+        Z_ARRVAL_P(intern->results), path->name)) != NULL) {
+        add_next_index_zval(matches, zv);
+    } else {
+        zend_symtable_update(Z_ARRVAL_P(intern->results), path->name, zv);
+    }
+}
 
-    simple_vector_init(&intern->paths, sizeof(json_path));
-    intern->objects_as_arrays = 0;
+static void json_path_call_callbacks(json_path_object *intern,
+    json_path *path, zval *zv)
+{
+    zval argv[2], retval;
+    int i;
+
+    ZVAL_STR_COPY(&argv[0], path->name);
+    ZVAL_COPY_VALUE(&argv[1], zv);
 
-    simple_vector_init(&intern->callbacks, sizeof(zval *));
-    simple_vector_init(&intern->path_stack, sizeof(json_path_stack_elem));
+    for (i=0; i < intern->callbacks.len; i++) {
+        json_path_callback *curr_callback = simple_vector_get(
+            &intern->callbacks, json_path_callback, i);
+
+        ZVAL_UNDEF(&retval);
+        curr_callback->fci.retval = &retval;
+        curr_callback->fci.params = argv;
+        curr_callback->fci.param_count = 2;
+
+        if (SUCCESS != zend_call_function(&curr_callback->fci,
+            &curr_callback->fcc) || Z_ISUNDEF(retval)) {
+            if (!EG(exception)) {
+                php_error_docref(NULL, E_WARNING, "Failed to call callback");
+            }
+        }
 
-    zend_object_std_init(&intern->zo, class_type TSRMLS_CC);
-    zend_hash_copy(intern->zo.properties, 
-        &class_type->default_properties, 
-        (copy_ctor_func_t) zval_add_ref,
-        (void *) &tmp,
-        sizeof(zval *));
+        zval_ptr_dtor(&retval);
 
-    retval.handle = zend_objects_store_put(intern,
-        NULL,
-        (zend_objects_free_object_storage_t) json_path_object_free_storage,
-        NULL TSRMLS_CC);
-    retval.handlers = (zend_object_handlers *) &json_path_object_handlers;
+        if (EG(exception)) {
+            break;
+        }
+    }
 
-    return retval; 
+    zval_ptr_dtor(&argv[0]);
 }
 
-static PHP_MINIT_FUNCTION(json_path)
+static void json_path_transform_write(json_path_transform *t,
+    const char *buf, size_t len)
 {
-    zend_class_entry ce;
-    memset(&ce, 0, sizeof(zend_class_entry));
-    INIT_CLASS_ENTRY(ce, "JsonPath", json_path_object_fe);
-    ce.create_object = json_path_object_new;
-    json_path_object_ce = zend_register_internal_class_ex(&ce, NULL, 
-        NULL TSRMLS_CC);
-    memcpy(&json_path_object_handlers, zend_get_std_object_handlers(), 
-        sizeof(zend_object_handlers));
+    smart_str_appendl(&t->out_buf, buf, len);
 
-    return SUCCESS;
+    if (ZSTR_LEN(t->out_buf.s) >= JSON_PATH_READ_BUFFER_SIZE) {
+        php_stream_write(t->out, ZSTR_VAL(t->out_buf.s),
+            ZSTR_LEN(t->out_buf.s));
+        ZSTR_LEN(t->out_buf.s) = 0;
+    }
 }
 
-static PHP_GINIT_FUNCTION(json_path)
+/* Appends a chunk that is about to be tokenized. Everything before
+ * pending_head has been written or dropped already. */
+static void json_path_transform_input(json_path_transform *t,
+    const unsigned char *buf, size_t len)
 {
+    size_t keep = t->pending_len - t->pending_head;
 
-}
+    if (t->pending_head > 0) {
+        memmove(t->pending, t->pending + t->pending_head, keep);
+        t->pending_head = 0;
+        t->pending_len = keep;
+    }
 
-zend_module_entry json_path_module_entry = {
-    STANDARD_MODULE_HEADER,
-    "json_path",
-    NULL,
-    PHP_MINIT(json_path),
-    NULL,
-    NULL,
-    NULL,
-    PHP_MINFO(json_path),
-    PHP_JSON_PATH_VERSION,
-    PHP_MODULE_GLOBALS(json_path),
-    PHP_GINIT(json_path),
-    NULL,
-    NULL,
-    STANDARD_MODULE_PROPERTIES_EX
-};
+    if (keep + len > t->pending_size) {
+        t->pending_size = keep + len;
+        t->pending = erealloc(t->pending, t->pending_size);
+    }
 
-#ifdef COMPILE_DL_JSON_PATH
-ZEND_GET_MODULE(json_path)
-#endif
+    memcpy(t->pending + keep, buf, len);
+    t->pending_len += len;
+    t->chunk_off = t->input_off;
+    t->input_off += len;
+}
 
-static PHP_MINFO_FUNCTION(json_path)
+static inline unsigned char json_path_transform_byte(json_path_transform *t,
+    uint64_t pos)
 {
-    php_info_print_table_start();
-    php_info_print_table_row(2, "json path support", "enabled");
-    php_info_print_table_row(2, "json path version", PHP_JSON_PATH_VERSION);
-    php_info_print_table_end();
+    return t->pending[t->pending_head + (pos - t->pending_off)];
 }
 
-#define FETCH_THIS_AND_INTERN() \
-    zval *this = getThis(); \
-    json_path_object *intern = zend_object_store_get_object(this TSRMLS_CC);
-
-PHP_METHOD(JsonPath, addPath)
+/* Copies pending input up to pos to the output */
+static void json_path_transform_flush(json_path_transform *t, uint64_t pos)
 {
-    FETCH_THIS_AND_INTERN();
-    char *name = NULL;
-    int name_len = 0;
-    json_path path;
+    size_t n;
 
-    if (SUCCESS != zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s", &name, 
-        &name_len)) {
-        RETURN_FALSE;
+    if (pos <= t->pending_off) {
+        return;
     }
 
-    simple_vector_init(&path.components, sizeof(json_path_component));
-    path.name = estrndup(name, name_len);
-    path.name_len = name_len;
-
-    simple_vector_init(&path.collection_stack, sizeof(zval *));
-
-    path.status = STATUS_MATCHING;
-
-    if (json_path_parse(&path)) {
-        simple_vector_append(&intern->paths, &path);
-        RETURN_TRUE;
-    } else {
-        json_path_free(&path);
-        RETURN_FALSE;
-    }
+    n = pos - t->pending_off;
+    json_path_transform_write(t, (const char *) t->pending + t->pending_head,
+        n);
+    t->pending_head += n;
+    t->pending_off = pos;
 }
 
-PHP_METHOD(JsonPath, getPaths)
+/* Discards pending input up to pos */
+static void json_path_transform_drop(json_path_transform *t, uint64_t pos)
 {
-    FETCH_THIS_AND_INTERN();
-    int i;
-
-    array_init(return_value);
-
-    for (i=0; i < intern->paths.len; i++) {
-        json_path *path = simple_vector_get(&intern->paths, json_path, i);
-        add_next_index_string(return_value, path->name, 1);
+    if (pos <= t->pending_off) {
+        return;
     }
+
+    t->pending_head += pos - t->pending_off;
+    t->pending_off = pos;
 }
 
-PHP_METHOD(JsonPath, addCallback)
+/* Returns the start of the token after pos, skipping whitespace and
+ * separators. The position of a skipped comma is stored in comma. */
+static uint64_t json_path_transform_skip(json_path_transform *t, uint64_t pos,
+    uint64_t *comma)
 {
-    FETCH_THIS_AND_INTERN();
-    zval *callback;
+    *comma = JSON_PATH_NO_OFFSET;
 
-    if (SUCCESS != zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z", 
-        &callback)) {
-        RETURN_FALSE;
-    }
+    while (pos < t->input_off) {
+        unsigned char c = json_path_transform_byte(t, pos);
 
-    if (!zend_is_callable(callback, 0, NULL)) {
-        php_error_docref(NULL TSRMLS_CC, E_WARNING, "Argument is not callable");
-        RETURN_FALSE;
+        if (c == ',') {
+            *comma = pos;
+        } else if (c != ' ' && c != '\t' && c != '\n' && c != '\r' &&
+            c != ':') {
+            break;
+        }
+        pos++;
     }
 
-    zval_add_ref(&callback);
-    simple_vector_append(&intern->callbacks, &callback);
+    return pos;
+}
 
-    RETURN_TRUE;
+/* End offset of the token the tokenizer is reporting */
+static inline uint64_t json_path_transform_token_end(json_path_object *intern)
+{
+    return intern->transform->chunk_off + yajl_get_bytes_consumed(intern->yh);
 }
 
-PHP_METHOD(JsonPath, getCallbacks)
+static json_path *json_path_transform_new_match(json_path_object *intern)
 {
-    FETCH_THIS_AND_INTERN();
     int i;
 
-    array_init(return_value);
-
     for (i=0; i < intern->paths.len; i++) {
-        zval *callback = *simple_vector_get(&intern->callbacks, zval *, i);
-        add_next_index_zval(return_value, callback);
+        json_path *path = simple_vector_get(&intern->paths, json_path, i);
+
+        if (path->status == STATUS_COLLECTING && !path->aggregate &&
+            path->collection_stack.len == 0 && path->skip_depth == 0) {
+            return path;
+        }
     }
+
+    return NULL;
 }
 
-PHP_METHOD(JsonPath, setObjectsAsArrays)
+/* Runs before a token is handled, once the matcher has seen it. Input
+ * before the token is either copied through or, inside a match, dropped.
+ * A removed member takes its leading comma with it; when it has none
+ * (first member), the comma after it is dropped instead. */
+static void json_path_transform_before(json_path_object *intern, int is_key,
+    int is_end)
 {
-    FETCH_THIS_AND_INTERN();
-    zend_bool objects_as_arrays;
+    json_path_transform *t = intern->transform;
+    json_path_stack_elem *top = NULL;
+    uint64_t start, comma;
+    json_path *match;
+
+    if (t->active) {
+        if (t->replace_pending && !is_key && !is_end) {
+            /* keep the member's key, replace from the value on */
+            start = json_path_transform_skip(t, t->last_token_end, &comma);
+            json_path_transform_flush(t, start);
+            t->replace_pending = 0;
+        } else if (!t->replace_pending) {
+            json_path_transform_drop(t, t->last_token_end);
+        }
+        return;
+    }
 
-    if (SUCCESS != zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "b", 
-        &objects_as_arrays)) {
-        RETURN_FALSE;
+    if (is_end) {
+        if (t->skip_comma_depth == intern->path_stack.len) {
+            t->skip_comma_depth = -1;
+        }
+        json_path_transform_flush(t, t->last_token_end);
+        return;
     }
 
-    intern->objects_as_arrays = objects_as_arrays;
-
-    RETURN_TRUE;
-}
-
-PHP_METHOD(JsonPath, getObjectsAsArrays)
-{
-    FETCH_THIS_AND_INTERN();
-    RETURN_BOOL(intern->objects_as_arrays);
-}
-
-static int json_path_on_null(void *ctx)
-{
-    json_path_object *intern = (json_path_object *) ctx;
-    int i;
+    if (intern->path_stack.len > 0) {
+        top = simple_vector_get_last(&intern->path_stack, json_path_stack_elem);
+    }
 
-    json_path_check_for_array_matches(intern);
+    /* object values are preceded by their key, which was handled already */
+    if (!is_key && (!top || top->type != TYPE_ARRAY)) {
+        json_path_transform_flush(t, t->last_token_end);
+        return;
+    }
 
-    for (i=0; i < intern->paths.len; i++) {
-        json_path *curr = simple_vector_get(&intern->paths, json_path, i);
+    start = json_path_transform_skip(t, t->last_token_end, &comma);
 
-        if (curr->status == STATUS_COLLECTING) {
-            zval *zv;
+    if (t->skip_comma_depth == intern->path_stack.len) {
+        if (comma != JSON_PATH_NO_OFFSET) {
+            json_path_transform_flush(t, comma);
+            json_path_transform_drop(t, comma + 1);
+            comma = JSON_PATH_NO_OFFSET;
+        }
+        t->skip_comma_depth = -1;
+    }
 
-            MAKE_STD_ZVAL(zv);
-            ZVAL_NULL(zv);
+    match = json_path_transform_new_match(intern);
 
-            json_path_collected_zval(intern, curr, zv);
+    if (!match) {
+        json_path_transform_flush(t, t->last_token_end);
+        return;
+    }
 
-            zval_ptr_dtor(&zv);
+    t->active = match;
 
-            if (curr->collection_stack.len == 0) {
-                curr->status = STATUS_MATCHING;
-            }
+    if (t->mode == JSON_PATH_TRANSFORM_REMOVE) {
+        if (comma != JSON_PATH_NO_OFFSET) {
+            json_path_transform_flush(t, comma);
+        } else {
+            json_path_transform_flush(t, start);
+            t->skip_comma_depth = intern->path_stack.len;
         }
+    } else if (is_key) {
+        json_path_transform_flush(t, t->last_token_end);
+        t->replace_pending = 1;
+    } else {
+        json_path_transform_flush(t, start);
     }
+}
 
-    return 1;
+static inline void json_path_transform_after(json_path_object *intern)
+{
+    intern->transform->last_token_end = json_path_transform_token_end(intern);
 }
 
-static int json_path_on_boolean(void *ctx, int val)
+static int json_path_transform_encode(smart_str *buf, zval *zv)
 {
-    json_path_object *intern = (json_path_object *) ctx;
-    int i;
+    JSON_G(error_code) = PHP_JSON_ERROR_NONE;
+    php_json_encode(buf, zv, PHP_JSON_UNESCAPED_SLASHES |
+        PHP_JSON_UNESCAPED_UNICODE);
 
-    json_path_check_for_array_matches(intern);
+    if (JSON_G(error_code) != PHP_JSON_ERROR_NONE || !buf->s) {
+        php_error_docref(NULL, E_WARNING, "Failed encoding replacement");
+        return 0;
+    }
 
-    for (i=0; i < intern->paths.len; i++) {
-        json_path *curr = simple_vector_get(&intern->paths, json_path, i);
+    smart_str_0(buf);
 
-        if (curr->status == STATUS_COLLECTING) {
-            zval *zv;
+    return 1;
+}
 
-            MAKE_STD_ZVAL(zv);
-            ZVAL_BOOL(zv, val);
+/* The matched node ends with the current token: drop what is left of it
+ * and, when replacing, write the replacement. Returns 0 if path is not
+ * the match being transformed. */
+static int json_path_transform_done(json_path_object *intern,
+    json_path *path)
+{
+    json_path_transform *t = intern->transform;
 
-            json_path_collected_zval(intern, curr, zv);
+    if (path != t->active) {
+        return 0;
+    }
 
-            zval_ptr_dtor(&zv);
+    json_path_transform_drop(t, json_path_transform_token_end(intern));
+    t->active = NULL;
 
-            if (curr->collection_stack.len == 0) {
-                curr->status = STATUS_MATCHING;
-            }
-        }
+    if (t->mode == JSON_PATH_TRANSFORM_REPLACE) {
+        json_path_transform_write(t, ZSTR_VAL(t->replacement.s),
+            ZSTR_LEN(t->replacement.s));
     }
 
     return 1;
 }
 
-static int json_path_on_integer(void *ctx, long long val)
+/* Remove and replace never look at the matched value, so there a match
+ * is followed by its depth alone instead of being built. delta is 1 for
+ * a container start, -1 for its end and 0 for a scalar. Returns 0 when
+ * the value has to be built after all. */
+static int json_path_transform_track(json_path_object *intern,
+    json_path *path, int delta)
 {
-    json_path_object *intern = (json_path_object *) ctx;
-    int i;
+    if (!intern->transform ||
+        intern->transform->mode == JSON_PATH_TRANSFORM_CALLBACK) {
+        return 0;
+    }
 
-    json_path_check_for_array_matches(intern);
+    path->skip_depth += delta;
 
-    for (i=0; i < intern->paths.len; i++) {
-        json_path *curr = simple_vector_get(&intern->paths, json_path, i);
+    if (delta <= 0 && path->skip_depth == 0) {
+        json_path_transform_done(intern, path);
+        path->status = STATUS_MATCHING;
+    }
 
-        if (curr->status == STATUS_COLLECTING) {
-            zval *zv;
+    return 1;
+}
 
-            MAKE_STD_ZVAL(zv);
-            ZVAL_LONG(zv, (long) val);
+/* Hands a finished match to the callback in callback mode. Consumes zv. */
+static void json_path_transform_collected(json_path_object *intern,
+    json_path *path, zval *zv)
+{
+    json_path_transform *t = intern->transform;
 
-            json_path_collected_zval(intern, curr, zv);
+    if (json_path_transform_done(intern, path) &&
+        t->mode == JSON_PATH_TRANSFORM_CALLBACK) {
+        zval argv[2], retval;
+        smart_str buf = {0};
 
-            zval_ptr_dtor(&zv);
+        ZVAL_STR_COPY(&argv[0], path->name);
+        ZVAL_COPY_VALUE(&argv[1], zv);
+        ZVAL_UNDEF(&retval);
 
-            if (curr->collection_stack.len == 0) {
-                curr->status = STATUS_MATCHING;
+        t->callback.fci.retval = &retval;
+        t->callback.fci.params = argv;
+        t->callback.fci.param_count = 2;
+
+        if (SUCCESS != zend_call_function(&t->callback.fci,
+            &t->callback.fcc) || Z_ISUNDEF(retval) || EG(exception)) {
+            if (!EG(exception)) {
+                php_error_docref(NULL, E_WARNING, "Failed to call callback");
             }
+            t->failed = 1;
+        } else if (!json_path_transform_encode(&buf, &retval)) {
+            t->failed = 1;
+        } else {
+            json_path_transform_write(t, ZSTR_VAL(buf.s), ZSTR_LEN(buf.s));
         }
+
+        smart_str_free(&buf);
+        zval_ptr_dtor(&retval);
+        zval_ptr_dtor(&argv[0]);
     }
 
-    return 1;
+    zval_ptr_dtor(zv);
 }
 
-static int json_path_on_double(void *ctx, double val)
+/* Consumes zv, whichever way the match is delivered. */
+static void json_path_collected_zval(json_path_object *intern,
+    json_path *path, zval *zv)
 {
-    json_path_object *intern = (json_path_object *) ctx;
-    int i;
-
-    json_path_check_for_array_matches(intern);
+    if (path->collection_stack.len == 0 && intern->transform) {
+        json_path_transform_collected(intern, path, zv);
+    } else if (path->collection_stack.len == 0 && intern->results) {
+        json_path_add_result(intern, path, zv);
+    } else if (path->collection_stack.len == 0) {
+        json_path_call_callbacks(intern, path, zv);
+        zval_ptr_dtor(zv);
+    } else {
+        json_path_append_zval(intern, path, zv);
+    }
+}
 
-    for (i=0; i < intern->paths.len; i++) {
-        json_path *curr = simple_vector_get(&intern->paths, json_path, i);
+/* 64-bit FNV-1a, finished with the MurmurHash3 mixer so that the top
+ * bits used for the register index are well distributed. */
+static uint64_t json_path_hash(unsigned char tag, const unsigned char *buf,
+    size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
 
-        if (curr->status == STATUS_COLLECTING) {
-            zval *zv;
+    h = (h ^ tag) * 0x100000001b3ULL;
+    for (i=0; i < len; i++) {
+        h = (h ^ buf[i]) * 0x100000001b3ULL;
+    }
 
-            MAKE_STD_ZVAL(zv);
-            ZVAL_DOUBLE(zv, val);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
 
-            json_path_collected_zval(intern, curr, zv);
+    return h;
+}
 
-            zval_ptr_dtor(&zv);
+static void json_path_hll_add(json_path_aggregate *agg, uint64_t h)
+{
+    size_t slot = h >> (64 - JSON_PATH_HLL_BITS);
+    uint64_t w = (h << JSON_PATH_HLL_BITS) |
+        ((uint64_t) 1 << (JSON_PATH_HLL_BITS - 1));
+    unsigned char rank = 1;
+
+    while (!(w & 0x8000000000000000ULL)) {
+        rank++;
+        w <<= 1;
+    }
 
-            if (curr->collection_stack.len == 0) {
-                curr->status = STATUS_MATCHING;
-            }
-        }
+    if (!agg->registers) {
+        agg->registers = ecalloc(JSON_PATH_HLL_REGISTERS, 1);
     }
 
-    return 1;
+    if (rank > agg->registers[slot]) {
+        agg->registers[slot] = rank;
+    }
 }
 
-static int json_path_on_string(void *ctx, const unsigned char *val, size_t val_len)
+static zend_long json_path_hll_count(json_path_aggregate *agg)
 {
-    json_path_object *intern = (json_path_object *) ctx;
-    int i;
+    double m = JSON_PATH_HLL_REGISTERS, sum = 0, estimate;
+    int i, zeros = 0;
 
-    json_path_check_for_array_matches(intern);
+    if (!agg->registers) {
+        return 0;
+    }
 
-    for (i=0; i < intern->paths.len; i++) {
-        json_path *curr = simple_vector_get(&intern->paths, json_path, i);
+    for (i=0; i < JSON_PATH_HLL_REGISTERS; i++) {
+        sum += ldexp(1.0, -agg->registers[i]);
+        if (agg->registers[i] == 0) {
+            zeros++;
+        }
+    }
 
-        if (curr->status == STATUS_COLLECTING) {
-            zval *zv;
+    estimate = (0.7213 / (1 + 1.079 / m)) * m * m / sum;
 
-            MAKE_STD_ZVAL(zv);
-            ZVAL_STRINGL(zv, val, val_len, 1);
+    /* linear counting is more accurate while registers are still empty */
+    if (estimate <= 2.5 * m && zeros > 0) {
+        estimate = m * log(m / zeros);
+    }
 
-            json_path_collected_zval(intern, curr, zv);
+    return (zend_long) (estimate + 0.5);
+}
 
-            zval_ptr_dtor(&zv);
+static inline double json_path_number_double(json_path_number *n)
+{
+    return n->is_double ? n->d : (double) n->l;
+}
 
-            if (curr->collection_stack.len == 0) {
-                curr->status = STATUS_MATCHING;
-            }
-        }
+static inline int json_path_number_less(json_path_number *a,
+    json_path_number *b)
+{
+    if (!a->is_double && !b->is_double) {
+        return a->l < b->l;
     }
 
-    return 1;
+    return json_path_number_double(a) < json_path_number_double(b);
 }
 
-static int json_path_on_start_map(void *ctx)
+static void json_path_aggregate_number(json_path_aggregate *agg,
+    json_path_number *n)
 {
-    json_path_object *intern = (json_path_object *) ctx;
-    json_path_stack_elem stack_elem;
-    int i;
-
-    json_path_check_for_array_matches(intern);
+    if (!agg->sum.is_double && !n->is_double &&
+        !((n->l > 0 && agg->sum.l > ZEND_LONG_MAX - n->l) ||
+        (n->l < 0 && agg->sum.l < ZEND_LONG_MIN - n->l))) {
+        agg->sum.l += n->l;
+    } else {
+        /* like PHP's own arithmetic, overflow continues as float */
+        agg->sum.d = json_path_number_double(&agg->sum) +
+            json_path_number_double(n);
+        agg->sum.is_double = 1;
+    }
 
-    for (i=0; i < intern->paths.len; i++) {
-        json_path *curr = simple_vector_get(&intern->paths, json_path, i);
+    if (agg->count == 0 || json_path_number_less(n, &agg->min)) {
+        agg->min = *n;
+    }
 
-        if (curr->status == STATUS_COLLECTING) {
-            zval *zv;
+    if (agg->count == 0 || json_path_number_less(&agg->max, n)) {
+        agg->max = *n;
+    }
 
-            MAKE_STD_ZVAL(zv);
+    agg->count++;
+}
 
-            if (intern->objects_as_arrays) {
-                array_init(zv);
-            } else {
-                object_init(zv);
-            }
+/* Folds a matched scalar. type is the zval type the value would have had;
+ * strings are hashed from the tokenizer's buffer. */
+static void json_path_aggregate_scalar(json_path *path, zend_uchar type,
+    zend_long l, double d, const unsigned char *val, size_t val_len)
+{
+    json_path_aggregate *agg = path->aggregate;
+    json_path_number n;
 
-            simple_vector_append(&curr->collection_stack, &zv);
-        }
+    if (agg->depth > 0) {
+        return;
     }
 
-    stack_elem.type = TYPE_OBJECT;
-    stack_elem.key = NULL;
-    stack_elem.key_len = 0;
-
-    simple_vector_append(&intern->path_stack, &stack_elem);
+    path->status = STATUS_MATCHING;
 
-    return 1;
+    switch (agg->op) {
+        case JSON_PATH_AGGREGATE_COUNT:
+            agg->count++;
+            break;
+        case JSON_PATH_AGGREGATE_DISTINCT:
+            /* integral floats hash like the integer they equal */
+            if (type == IS_DOUBLE && d >= (double) ZEND_LONG_MIN &&
+                d < (double) ZEND_LONG_MAX && d == (double) (zend_long) d) {
+                type = IS_LONG;
+                l = (zend_long) d;
+            }
+            if (type == IS_LONG) {
+                json_path_hll_add(agg, json_path_hash('i',
+                    (const unsigned char *) &l, sizeof(l)));
+            } else if (type == IS_DOUBLE) {
+                json_path_hll_add(agg, json_path_hash('d',
+                    (const unsigned char *) &d, sizeof(d)));
+            } else if (type == IS_STRING) {
+                json_path_hll_add(agg, json_path_hash('s', val, val_len));
+            } else {
+                json_path_hll_add(agg, json_path_hash((unsigned char) type,
+                    NULL, 0));
+            }
+            break;
+        default:
+            if (type == IS_LONG) {
+                n.is_double = 0;
+                n.l = l;
+                json_path_aggregate_number(agg, &n);
+            } else if (type == IS_DOUBLE) {
+                n.is_double = 1;
+                n.d = d;
+                json_path_aggregate_number(agg, &n);
+            }
+            break;
+    }
 }
 
-static int json_path_on_map_key(void *ctx, const unsigned char *val, size_t val_len)
+static inline void json_path_aggregate_start(json_path *path)
 {
-    json_path_object *intern = (json_path_object *) ctx;
-    json_path_stack_elem *stack_elem = simple_vector_get_last(
-        &intern->path_stack, json_path_stack_elem);
+    path->aggregate->depth++;
+}
 
-    json_path_check_for_array_matches(intern);
+/* A matched container only counts as one value for COUNT */
+static void json_path_aggregate_end(json_path *path)
+{
+    json_path_aggregate *agg = path->aggregate;
 
-    if (stack_elem->key) {
-        efree(stack_elem->key);
+    if (--agg->depth == 0) {
+        path->status = STATUS_MATCHING;
+        if (agg->op == JSON_PATH_AGGREGATE_COUNT) {
+            agg->count++;
+        }
     }
-
-    stack_elem->key = estrndup(val, val_len);
-    stack_elem->key_len = val_len;
-
-    json_path_check_for_matches(intern);
-
-    return 1;
 }
 
-static int json_path_on_end_map(void *ctx)
+static void json_path_aggregate_reset(json_path_object *intern)
 {
-    json_path_object *intern = (json_path_object *) ctx;
-    json_path_stack_elem *stack_elem = simple_vector_get_last(
-        &intern->path_stack, json_path_stack_elem);
     int i;
 
-    if (stack_elem->key) {
-        efree(stack_elem->key);
-        stack_elem->key = NULL;
+    for (i=0; i < intern->paths.len; i++) {
+        json_path *path = simple_vector_get(&intern->paths, json_path, i);
+        json_path_aggregate *agg = path->aggregate;
+
+        if (agg) {
+            path->status = STATUS_MATCHING;
+            agg->depth = 0;
+            agg->count = 0;
+            memset(&agg->sum, 0, sizeof(agg->sum));
+            if (agg->registers) {
+                memset(agg->registers, 0, JSON_PATH_HLL_REGISTERS);
+            }
+        }
     }
+}
 
-    simple_vector_pop(&intern->path_stack);
+static void json_path_number_zval(json_path_number *n, zval *zv)
+{
+    if (n->is_double) {
+        ZVAL_DOUBLE(zv, n->d);
+    } else {
+        ZVAL_LONG(zv, n->l);
+    }
+}
+
+/* Hands each aggregate to extract() or the callbacks, once per parse.
+ * MIN, MAX and AVG are null when no numbers matched. */
+static void json_path_aggregate_deliver(json_path_object *intern)
+{
+    int i;
 
     for (i=0; i < intern->paths.len; i++) {
-        json_path *curr = simple_vector_get(&intern->paths, json_path, i);
+        json_path *path = simple_vector_get(&intern->paths, json_path, i);
+        json_path_aggregate *agg = path->aggregate;
+        zval zv;
 
-        if (curr->status == STATUS_COLLECTING) {
-            zval *zv = *simple_vector_get_last(&curr->collection_stack, zval *);
-            simple_vector_pop(&curr->collection_stack);
+        if (!agg) {
+            continue;
+        }
 
-            json_path_collected_zval(intern, curr, zv);
-            zval_ptr_dtor(&zv);
+        switch (agg->op) {
+            case JSON_PATH_AGGREGATE_COUNT:
+                ZVAL_LONG(&zv, agg->count);
+                break;
+            case JSON_PATH_AGGREGATE_SUM:
+                json_path_number_zval(&agg->sum, &zv);
+                break;
+            case JSON_PATH_AGGREGATE_MIN:
+            case JSON_PATH_AGGREGATE_MAX:
+                if (agg->count == 0) {
+                    ZVAL_NULL(&zv);
+                } else {
+                    json_path_number_zval(agg->op == JSON_PATH_AGGREGATE_MIN ?
+                        &agg->min : &agg->max, &zv);
+                }
+                break;
+            case JSON_PATH_AGGREGATE_AVG:
+                if (agg->count == 0) {
+                    ZVAL_NULL(&zv);
+                } else {
+                    ZVAL_DOUBLE(&zv, json_path_number_double(&agg->sum) /
+                        agg->count);
+                }
+                break;
+            default:
+                ZVAL_LONG(&zv, json_path_hll_count(agg));
+                break;
+        }
 
-            if (curr->collection_stack.len == 0) {
-                curr->status = STATUS_MATCHING;
-            }
+        if (intern->results) {
+            zend_symtable_update(Z_ARRVAL_P(intern->results), path->name, &zv);
+        } else {
+            json_path_call_callbacks(intern, path, &zv);
+            zval_ptr_dtor(&zv);
         }
     }
-
-    return 1;
 }
 
-static int json_path_on_start_array(void *ctx)
+static void json_path_session_abort(json_path_object *intern);
+
+static void json_path_object_free_storage(zend_object *object)
 {
-    json_path_object *intern = (json_path_object *) ctx;
-    json_path_stack_elem stack_elem;
+    json_path_object *intern = json_path_object_from_obj(object);
     int i;
 
-    json_path_check_for_array_matches(intern);
+    if (intern->session.active) {
+        json_path_session_abort(intern);
+    }
 
-    for (i=0; i < intern->paths.len; i++) {
-        json_path *curr = simple_vector_get(&intern->paths, json_path, i);
+    if (intern->pool) {
+        yajl_free(intern->pool);
+    }
 
-        if (curr->status == STATUS_COLLECTING) {
-            zval *zv;
+    simple_vector_free(&intern->binary.frames);
+    smart_str_free(&intern->binary.carry);
+    smart_str_free(&intern->binary.chunks);
 
-            MAKE_STD_ZVAL(zv);
-            array_init(zv);
+    json_path_vector_free(&intern->paths);
+    json_path_stack_free(&intern->path_stack);
 
-            simple_vector_append(&curr->collection_stack, &zv);
-        }
+    for (i=0; i < intern->callbacks.len; i++) {
+        json_path_callback *curr_callback = simple_vector_get(
+            &intern->callbacks, json_path_callback, i);
+        zval_ptr_dtor(&curr_callback->fci.function_name);
     }
 
-    stack_elem.type = TYPE_ARRAY;
-    stack_elem.index = -1;
+    simple_vector_free(&intern->callbacks);
 
-    simple_vector_append(&intern->path_stack, &stack_elem);
+    json_path_intern_clear(&intern->strings);
+    if (intern->strings.slots) {
+        efree(intern->strings.slots);
+        efree(intern->strings.filled);
+    }
 
-    return 1;
+    zend_object_std_dtor(&intern->zo);
 }
 
-static int json_path_on_end_array(void *ctx)
+static zend_object *json_path_object_new(zend_class_entry *class_type)
 {
-    json_path_object *intern = (json_path_object *) ctx;
-    json_path_stack_elem *stack_elem = simple_vector_get_last(
-        &intern->path_stack, json_path_stack_elem);
-    int i;
-
-    simple_vector_pop(&intern->path_stack);
+    json_path_object *intern;
 
-    for (i=0; i < intern->paths.len; i++) {
-        json_path *curr = simple_vector_get(&intern->paths, json_path, i);
+    intern = ecalloc(1, sizeof(json_path_object) +
+        zend_object_properties_size(class_type));
 
-        if (curr->status == STATUS_COLLECTING) {
-            zval *zv = *simple_vector_get_last(&curr->collection_stack, zval *);
-            simple_vector_pop(&curr->collection_stack);
+    simple_vector_init(&intern->paths, sizeof(json_path));
+    intern->objects_as_arrays = 0;
+    intern->read_ahead = 0;
+    intern->parallelism = 1;
+    intern->format = JSON_PATH_FORMAT_JSON;
+    simple_vector_init(&intern->binary.frames, sizeof(json_path_binary_frame));
+    memset(&intern->binary.carry, 0, sizeof(smart_str));
+    memset(&intern->binary.chunks, 0, sizeof(smart_str));
+    intern->results = NULL;
+    intern->transform = NULL;
+    intern->profile = NULL;
+    intern->session.active = 0;
+    ZVAL_UNDEF(&intern->session.input);
+    intern->session.buf = NULL;
+    intern->yh = NULL;
+    intern->pool = NULL;
+    intern->strings.slots = NULL;
+    intern->strings.filled = NULL;
+    intern->strings.used = 0;
+    intern->strings.enabled = 1;
+
+    simple_vector_init(&intern->callbacks, sizeof(json_path_callback));
+    simple_vector_init_size(&intern->path_stack, sizeof(json_path_stack_elem),
+        JSON_PATH_STACK_SIZE);
+
+    zend_object_std_init(&intern->zo, class_type);
+    object_properties_init(&intern->zo, class_type);
+
+    intern->zo.handlers = &json_path_object_handlers;
+
+    return &intern->zo;
+}
 
-            json_path_collected_zval(intern, curr, zv);
-            zval_ptr_dtor(&zv);
+static PHP_MINIT_FUNCTION(json_path)
+{
+    zend_class_entry ce;
+    INIT_CLASS_ENTRY(ce, "JsonPath", json_path_object_fe);
+    ce.create_object = json_path_object_new;
+    json_path_object_ce = zend_register_internal_class(&ce);
+    memcpy(&json_path_object_handlers, zend_get_std_object_handlers(),
+        sizeof(zend_object_handlers));
+    json_path_object_handlers.offset = XtOffsetOf(json_path_object, zo);
+    json_path_object_handlers.free_obj = json_path_object_free_storage;
+    json_path_object_handlers.clone_obj = NULL;
+
+    zend_declare_class_constant_long(json_path_object_ce, "TRANSFORM_REMOVE",
+        sizeof("TRANSFORM_REMOVE")-1, JSON_PATH_TRANSFORM_REMOVE);
+    zend_declare_class_constant_long(json_path_object_ce, "TRANSFORM_REPLACE",
+        sizeof("TRANSFORM_REPLACE")-1, JSON_PATH_TRANSFORM_REPLACE);
+    zend_declare_class_constant_long(json_path_object_ce, "TRANSFORM_CALLBACK",
+        sizeof("TRANSFORM_CALLBACK")-1, JSON_PATH_TRANSFORM_CALLBACK);
+    zend_declare_class_constant_long(json_path_object_ce, "PARSE_COMPLETE",
+        sizeof("PARSE_COMPLETE")-1, JSON_PATH_PARSE_COMPLETE);
+    zend_declare_class_constant_long(json_path_object_ce, "PARSE_INCOMPLETE",
+        sizeof("PARSE_INCOMPLETE")-1, JSON_PATH_PARSE_INCOMPLETE);
+    zend_declare_class_constant_long(json_path_object_ce, "AGGREGATE_COUNT",
+        sizeof("AGGREGATE_COUNT")-1, JSON_PATH_AGGREGATE_COUNT);
+    zend_declare_class_constant_long(json_path_object_ce, "AGGREGATE_SUM",
+        sizeof("AGGREGATE_SUM")-1, JSON_PATH_AGGREGATE_SUM);
+    zend_declare_class_constant_long(json_path_object_ce, "AGGREGATE_MIN",
+        sizeof("AGGREGATE_MIN")-1, JSON_PATH_AGGREGATE_MIN);
+    zend_declare_class_constant_long(json_path_object_ce, "AGGREGATE_MAX",
+        sizeof("AGGREGATE_MAX")-1, JSON_PATH_AGGREGATE_MAX);
+    zend_declare_class_constant_long(json_path_object_ce, "AGGREGATE_AVG",
+        sizeof("AGGREGATE_AVG")-1, JSON_PATH_AGGREGATE_AVG);
+    zend_declare_class_constant_long(json_path_object_ce, "AGGREGATE_DISTINCT",
+        sizeof("AGGREGATE_DISTINCT")-1, JSON_PATH_AGGREGATE_DISTINCT);
+    zend_declare_class_constant_long(json_path_object_ce, "FORMAT_JSON",
+        sizeof("FORMAT_JSON")-1, JSON_PATH_FORMAT_JSON);
+    zend_declare_class_constant_long(json_path_object_ce, "FORMAT_CBOR",
+        sizeof("FORMAT_CBOR")-1, JSON_PATH_FORMAT_CBOR);
+    zend_declare_class_constant_long(json_path_object_ce, "FORMAT_MSGPACK",
+        sizeof("FORMAT_MSGPACK")-1, JSON_PATH_FORMAT_MSGPACK);
 
-            if (curr->collection_stack.len == 0) {
-                curr->status = STATUS_MATCHING;
-            }
-        }
-    }
+    return SUCCESS;
+}
+
+static PHP_GINIT_FUNCTION(json_path)
+{
+#if defined(COMPILE_DL_JSON_PATH) && defined(ZTS)
+    ZEND_TSRMLS_CACHE_UPDATE();
+#endif
+}
+
+static const zend_module_dep json_path_deps[] = {
+    ZEND_MOD_REQUIRED("json")
+    ZEND_MOD_END
+};
+
+zend_module_entry json_path_module_entry = {
+    STANDARD_MODULE_HEADER_EX,
+    NULL,
+    json_path_deps,
+    "json_path",
+    NULL,
+    PHP_MINIT(json_path),
+    NULL,
+    NULL,
+    NULL,
+    PHP_MINFO(json_path),
+    PHP_JSON_PATH_VERSION,
+    PHP_MODULE_GLOBALS(json_path),
+    PHP_GINIT(json_path),
+    NULL,
+    NULL,
+    STANDARD_MODULE_PROPERTIES_EX
+};
+
+#ifdef COMPILE_DL_JSON_PATH
+#ifdef ZTS
+ZEND_TSRMLS_CACHE_DEFINE()
+#endif
+ZEND_GET_MODULE(json_path)
+#endif
+
+static PHP_MINFO_FUNCTION(json_path)
+{
+    php_info_print_table_start();
+    php_info_print_table_row(2, "json path support", "enabled");
+    php_info_print_table_row(2, "json path version", PHP_JSON_PATH_VERSION);
+#ifdef HAVE_JSON_PATH_ZLIB
+    php_info_print_table_row(2, "gzip input", "enabled");
+#else
+    php_info_print_table_row(2, "gzip input", "disabled");
+#endif
+#ifdef HAVE_JSON_PATH_ZSTD
+    php_info_print_table_row(2, "zstd input", "enabled");
+#else
+    php_info_print_table_row(2, "zstd input", "disabled");
+#endif
+#ifdef HAVE_JSON_PATH_THREADS
+    php_info_print_table_row(2, "read-ahead", "enabled");
+    php_info_print_table_row(2, "parallel parsing", "enabled");
+#else
+    php_info_print_table_row(2, "read-ahead", "disabled");
+    php_info_print_table_row(2, "parallel parsing", "disabled");
+#endif
+    php_info_print_table_end();
+}
+
+#define FETCH_THIS_AND_INTERN() \
+    json_path_object *intern = Z_JSON_PATH_P(getThis());
+
+/* The parse state lives on the object, so a match callback must not start
+ * another parse on the same object or change its paths */
+static int json_path_check_idle(json_path_object *intern)
+{
+    if (intern->in_parse) {
+        php_error_docref(NULL, E_WARNING,
+            "Cannot use a JsonPath from its own callbacks while it parses");
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Paths and options are fixed for the lifetime of a parseFor() session, so
+ * the setters also refuse until it completes, fails or is replaced */
+static int json_path_check_configurable(json_path_object *intern)
+{
+    if (!json_path_check_idle(intern)) {
+        return 0;
+    }
+
+    if (intern->session.active) {
+        php_error_docref(NULL, E_WARNING,
+            "Cannot change a JsonPath while a parseFor() is unfinished");
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Hydration skips the constructor, but the class must be instantiable */
+static int json_path_class_check(zend_class_entry *ce)
+{
+    if (ce->ce_flags & (ZEND_ACC_INTERFACE | ZEND_ACC_TRAIT |
+        ZEND_ACC_IMPLICIT_ABSTRACT_CLASS | ZEND_ACC_EXPLICIT_ABSTRACT_CLASS
+#ifdef ZEND_ACC_ENUM
+        | ZEND_ACC_ENUM
+#endif
+        )) {
+        php_error_docref(NULL, E_WARNING, "Cannot instantiate %s",
+            ZSTR_VAL(ce->name));
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Resolves a map of relative subpaths to class names into a table of
+ * class entries, or returns NULL after a warning. */
+static HashTable *json_path_class_map(HashTable *map)
+{
+    HashTable *class_map;
+    zend_class_entry *ce;
+    zend_string *subpath;
+    zval *class_name;
+
+    ALLOC_HASHTABLE(class_map);
+    zend_hash_init(class_map, zend_hash_num_elements(map), NULL, NULL, 0);
+
+    ZEND_HASH_FOREACH_STR_KEY_VAL(map, subpath, class_name) {
+        if (!subpath || Z_TYPE_P(class_name) != IS_STRING) {
+            php_error_docref(NULL, E_WARNING,
+                "Class map must map subpaths to class names");
+            goto failed;
+        }
+
+        ce = zend_lookup_class(Z_STR_P(class_name));
+        if (!ce) {
+            php_error_docref(NULL, E_WARNING, "Class %s not found",
+                Z_STRVAL_P(class_name));
+            goto failed;
+        }
+
+        if (!json_path_class_check(ce)) {
+            goto failed;
+        }
+
+        zend_hash_update_ptr(class_map, subpath, ce);
+    } ZEND_HASH_FOREACH_END();
+
+    return class_map;
+
+failed:
+    zend_hash_destroy(class_map);
+    FREE_HASHTABLE(class_map);
+    return NULL;
+}
+
+static int json_path_add(json_path_object *intern, zend_string *name,
+    zend_long aggregate, zend_class_entry *ce, HashTable *class_map)
+{
+    json_path path;
+
+    simple_vector_init(&path.components, sizeof(json_path_component));
+    path.name = zend_string_copy(name);
+    path.wildcard = 0;
+
+    simple_vector_init_size(&path.collection_stack, sizeof(zval),
+        JSON_PATH_STACK_SIZE);
+
+    path.status = STATUS_MATCHING;
+    path.aggregate = NULL;
+    path.skip_depth = 0;
+    path.ce = ce;
+    path.class_map = class_map;
+
+    if (aggregate) {
+        path.aggregate = ecalloc(1, sizeof(json_path_aggregate));
+        path.aggregate->op = aggregate;
+    }
+
+    if (json_path_parse(&path)) {
+        simple_vector_append(&intern->paths, &path);
+        return 1;
+    } else {
+        json_path_free(&path);
+        return 0;
+    }
+}
+
+PHP_METHOD(JsonPath, addPath)
+{
+    FETCH_THIS_AND_INTERN();
+    zend_string *name;
+    zend_class_entry *ce = NULL;
+    HashTable *map = NULL, *class_map = NULL;
+
+    if (SUCCESS != zend_parse_parameters(ZEND_NUM_ARGS(), "S|C!h", &name,
+        &ce, &map)) {
+        RETURN_FALSE;
+    }
+
+    if (!json_path_check_configurable(intern)) {
+        RETURN_FALSE;
+    }
+
+    if (ce && !json_path_class_check(ce)) {
+        RETURN_FALSE;
+    }
+
+    if (map && zend_hash_num_elements(map) > 0 &&
+        (class_map = json_path_class_map(map)) == NULL) {
+        RETURN_FALSE;
+    }
+
+    RETURN_BOOL(json_path_add(intern, name, 0, ce, class_map));
+}
+
+PHP_METHOD(JsonPath, aggregate)
+{
+    FETCH_THIS_AND_INTERN();
+    zend_string *name;
+    zend_long op;
+
+    if (SUCCESS != zend_parse_parameters(ZEND_NUM_ARGS(), "Sl", &name,
+        &op)) {
+        RETURN_FALSE;
+    }
+
+    if (!json_path_check_configurable(intern)) {
+        RETURN_FALSE;
+    }
+
+    if (op < JSON_PATH_AGGREGATE_COUNT || op > JSON_PATH_AGGREGATE_DISTINCT) {
+        php_error_docref(NULL, E_WARNING, "Unknown aggregate operation");
+        RETURN_FALSE;
+    }
+
+    RETURN_BOOL(json_path_add(intern, name, op, NULL, NULL));
+}
+
+PHP_METHOD(JsonPath, getPaths)
+{
+    FETCH_THIS_AND_INTERN();
+    int i;
+
+    array_init_size(return_value, intern->paths.len);
+
+    for (i=0; i < intern->paths.len; i++) {
+        json_path *path = simple_vector_get(&intern->paths, json_path, i);
+        add_next_index_str(return_value, zend_string_copy(path->name));
+    }
+}
+
+PHP_METHOD(JsonPath, addCallback)
+{
+    FETCH_THIS_AND_INTERN();
+    zval *callback;
+    json_path_callback cb;
+    char *error = NULL;
+
+    if (SUCCESS != zend_parse_parameters(ZEND_NUM_ARGS(), "z",
+        &callback)) {
+        RETURN_FALSE;
+    }
+
+    if (!json_path_check_configurable(intern)) {
+        RETURN_FALSE;
+    }
+
+    if (SUCCESS != zend_fcall_info_init(callback, 0, &cb.fci, &cb.fcc,
+        NULL, &error)) {
+        if (error) {
+            efree(error);
+        }
+        php_error_docref(NULL, E_WARNING, "Argument is not callable");
+        RETURN_FALSE;
+    }
+
+    if (error) {
+        efree(error);
+    }
+
+    Z_TRY_ADDREF(cb.fci.function_name);
+    simple_vector_append(&intern->callbacks, &cb);
+
+    RETURN_TRUE;
+}
+
+PHP_METHOD(JsonPath, getCallbacks)
+{
+    FETCH_THIS_AND_INTERN();
+    int i;
+
+    array_init_size(return_value, intern->callbacks.len);
+
+    for (i=0; i < intern->callbacks.len; i++) {
+        json_path_callback *callback = simple_vector_get(&intern->callbacks,
+            json_path_callback, i);
+        Z_TRY_ADDREF(callback->fci.function_name);
+        add_next_index_zval(return_value, &callback->fci.function_name);
+    }
+}
+
+PHP_METHOD(JsonPath, setObjectsAsArrays)
+{
+    FETCH_THIS_AND_INTERN();
+    zend_bool objects_as_arrays;
+
+    if (SUCCESS != zend_parse_parameters(ZEND_NUM_ARGS(), "b",
+        &objects_as_arrays)) {
+        RETURN_FALSE;
+    }
+
+    if (!json_path_check_configurable(intern)) {
+        RETURN_FALSE;
+    }
+
+    intern->objects_as_arrays = objects_as_arrays;
+
+    RETURN_TRUE;
+}
+
+PHP_METHOD(JsonPath, getObjectsAsArrays)
+{
+    FETCH_THIS_AND_INTERN();
+    RETURN_BOOL(intern->objects_as_arrays);
+}
+
+PHP_METHOD(JsonPath, setReadAhead)
+{
+    FETCH_THIS_AND_INTERN();
+    zend_bool read_ahead;
+
+    if (SUCCESS != zend_parse_parameters(ZEND_NUM_ARGS(), "b",
+        &read_ahead)) {
+        RETURN_FALSE;
+    }
+
+    if (!json_path_check_configurable(intern)) {
+        RETURN_FALSE;
+    }
+
+#ifndef HAVE_JSON_PATH_THREADS
+    if (read_ahead) {
+        php_error_docref(NULL, E_WARNING,
+            "Read-ahead is not supported by this build");
+        RETURN_FALSE;
+    }
+#endif
+
+    intern->read_ahead = read_ahead;
+
+    RETURN_TRUE;
+}
+
+PHP_METHOD(JsonPath, getReadAhead)
+{
+    FETCH_THIS_AND_INTERN();
+    RETURN_BOOL(intern->read_ahead);
+}
+
+PHP_METHOD(JsonPath, setParallelism)
+{
+    FETCH_THIS_AND_INTERN();
+    zend_long threads;
+
+    if (SUCCESS != zend_parse_parameters(ZEND_NUM_ARGS(), "l", &threads)) {
+        RETURN_FALSE;
+    }
+
+    if (!json_path_check_configurable(intern)) {
+        RETURN_FALSE;
+    }
+
+    if (threads < 1 || threads > JSON_PATH_MAX_PARALLELISM) {
+        php_error_docref(NULL, E_WARNING,
+            "Parallelism must be between 1 and %d", JSON_PATH_MAX_PARALLELISM);
+        RETURN_FALSE;
+    }
+
+#ifndef HAVE_JSON_PATH_THREADS
+    if (threads > 1) {
+        php_error_docref(NULL, E_WARNING,
+            "Parallel parsing is not supported by this build");
+        RETURN_FALSE;
+    }
+#endif
+
+    intern->parallelism = threads;
+
+    RETURN_TRUE;
+}
+
+PHP_METHOD(JsonPath, getParallelism)
+{
+    FETCH_THIS_AND_INTERN();
+    RETURN_LONG(intern->parallelism);
+}
+
+PHP_METHOD(JsonPath, setInputFormat)
+{
+    FETCH_THIS_AND_INTERN();
+    zend_long format;
+
+    if (SUCCESS != zend_parse_parameters(ZEND_NUM_ARGS(), "l", &format)) {
+        RETURN_FALSE;
+    }
+
+    if (!json_path_check_configurable(intern)) {
+        RETURN_FALSE;
+    }
+
+    if (format != JSON_PATH_FORMAT_JSON && format != JSON_PATH_FORMAT_CBOR &&
+        format != JSON_PATH_FORMAT_MSGPACK) {
+        php_error_docref(NULL, E_WARNING, "Unknown input format");
+        RETURN_FALSE;
+    }
+
+    intern->format = format;
+
+    RETURN_TRUE;
+}
+
+PHP_METHOD(JsonPath, getInputFormat)
+{
+    FETCH_THIS_AND_INTERN();
+    RETURN_LONG(intern->format);
+}
+
+PHP_METHOD(JsonPath, setInternStrings)
+{
+    FETCH_THIS_AND_INTERN();
+    zend_bool intern_strings;
+
+    if (SUCCESS != zend_parse_parameters(ZEND_NUM_ARGS(), "b",
+        &intern_strings)) {
+        RETURN_FALSE;
+    }
+
+    if (!json_path_check_configurable(intern)) {
+        RETURN_FALSE;
+    }
+
+    intern->strings.enabled = intern_strings;
+
+    RETURN_TRUE;
+}
+
+PHP_METHOD(JsonPath, getInternStrings)
+{
+    FETCH_THIS_AND_INTERN();
+    RETURN_BOOL(intern->strings.enabled);
+}
+
+/* The pooled tokenizer accepts any number of top-level values, so a
+ * second one in the same document is rejected here instead. depth is the
+ * nesting the value appears at. */
+static inline int json_path_top_value(json_path_object *intern, int depth)
+{
+    if (depth == intern->base_depth) {
+        return intern->values++ == 0;
+    }
+
+    return 1;
+}
+
+/* Top-level values are counted at the depth the stack of the active
+ * callbacks (the profiler's frames, or path_stack) has when a parse
+ * starts. */
+static inline void json_path_values_begin(json_path_object *intern)
+{
+    intern->base_depth = intern->profile ? intern->profile->frames.len :
+        intern->path_stack.len;
+    intern->values = 0;
+}
+
+static int json_path_on_null(void *ctx)
+{
+    json_path_object *intern = (json_path_object *) ctx;
+    int i;
+
+    if (!json_path_top_value(intern, intern->path_stack.len)) {
+        return 0;
+    }
+
+    json_path_check_for_array_matches(intern);
+
+    if (intern->transform) {
+        json_path_transform_before(intern, 0, 0);
+    }
+
+    for (i=0; i < intern->paths.len; i++) {
+        json_path *curr = simple_vector_get(&intern->paths, json_path, i);
+
+        if (curr->status == STATUS_COLLECTING) {
+            zval zv;
+
+            if (curr->aggregate) {
+                json_path_aggregate_scalar(curr, IS_NULL, 0, 0, NULL, 0);
+                continue;
+            }
+
+            if (json_path_transform_track(intern, curr, 0)) {
+                continue;
+            }
+
+            ZVAL_NULL(&zv);
+
+            json_path_collected_zval(intern, curr, &zv);
+
+            if (curr->collection_stack.len == 0) {
+                curr->status = STATUS_MATCHING;
+            }
+        }
+    }
+
+    if (intern->transform) {
+        json_path_transform_after(intern);
+    }
+
+    return !EG(exception);
+}
+
+static int json_path_on_boolean(void *ctx, int val)
+{
+    json_path_object *intern = (json_path_object *) ctx;
+    int i;
+
+    if (!json_path_top_value(intern, intern->path_stack.len)) {
+        return 0;
+    }
+
+    json_path_check_for_array_matches(intern);
+
+    if (intern->transform) {
+        json_path_transform_before(intern, 0, 0);
+    }
+
+    for (i=0; i < intern->paths.len; i++) {
+        json_path *curr = simple_vector_get(&intern->paths, json_path, i);
+
+        if (curr->status == STATUS_COLLECTING) {
+            zval zv;
+
+            if (curr->aggregate) {
+                json_path_aggregate_scalar(curr, val ? IS_TRUE : IS_FALSE, 0, 0,
+                    NULL, 0);
+                continue;
+            }
+
+            if (json_path_transform_track(intern, curr, 0)) {
+                continue;
+            }
+
+            ZVAL_BOOL(&zv, val);
+
+            json_path_collected_zval(intern, curr, &zv);
+
+            if (curr->collection_stack.len == 0) {
+                curr->status = STATUS_MATCHING;
+            }
+        }
+    }
+
+    if (intern->transform) {
+        json_path_transform_after(intern);
+    }
+
+    return !EG(exception);
+}
+
+static int json_path_on_integer(void *ctx, long long val)
+{
+    json_path_object *intern = (json_path_object *) ctx;
+    int i;
+
+    if (!json_path_top_value(intern, intern->path_stack.len)) {
+        return 0;
+    }
+
+    json_path_check_for_array_matches(intern);
+
+    if (intern->transform) {
+        json_path_transform_before(intern, 0, 0);
+    }
+
+    for (i=0; i < intern->paths.len; i++) {
+        json_path *curr = simple_vector_get(&intern->paths, json_path, i);
+
+        if (curr->status == STATUS_COLLECTING) {
+            zval zv;
+
+            if (curr->aggregate) {
+                json_path_aggregate_scalar(curr, IS_LONG, (zend_long) val, 0,
+                    NULL, 0);
+                continue;
+            }
+
+            if (json_path_transform_track(intern, curr, 0)) {
+                continue;
+            }
+
+            ZVAL_LONG(&zv, (zend_long) val);
+
+            json_path_collected_zval(intern, curr, &zv);
+
+            if (curr->collection_stack.len == 0) {
+                curr->status = STATUS_MATCHING;
+            }
+        }
+    }
+
+    if (intern->transform) {
+        json_path_transform_after(intern);
+    }
+
+    return !EG(exception);
+}
+
+static int json_path_on_double(void *ctx, double val)
+{
+    json_path_object *intern = (json_path_object *) ctx;
+    int i;
+
+    if (!json_path_top_value(intern, intern->path_stack.len)) {
+        return 0;
+    }
+
+    json_path_check_for_array_matches(intern);
+
+    if (intern->transform) {
+        json_path_transform_before(intern, 0, 0);
+    }
+
+    for (i=0; i < intern->paths.len; i++) {
+        json_path *curr = simple_vector_get(&intern->paths, json_path, i);
+
+        if (curr->status == STATUS_COLLECTING) {
+            zval zv;
+
+            if (curr->aggregate) {
+                json_path_aggregate_scalar(curr, IS_DOUBLE, 0, val, NULL, 0);
+                continue;
+            }
+
+            if (json_path_transform_track(intern, curr, 0)) {
+                continue;
+            }
+
+            ZVAL_DOUBLE(&zv, val);
+
+            json_path_collected_zval(intern, curr, &zv);
+
+            if (curr->collection_stack.len == 0) {
+                curr->status = STATUS_MATCHING;
+            }
+        }
+    }
+
+    if (intern->transform) {
+        json_path_transform_after(intern);
+    }
+
+    return !EG(exception);
+}
+
+static int json_path_on_string(void *ctx, const unsigned char *val, size_t val_len)
+{
+    json_path_object *intern = (json_path_object *) ctx;
+    int i;
+
+    if (!json_path_top_value(intern, intern->path_stack.len)) {
+        return 0;
+    }
+
+    json_path_check_for_array_matches(intern);
+
+    if (intern->transform) {
+        json_path_transform_before(intern, 0, 0);
+    }
+
+    for (i=0; i < intern->paths.len; i++) {
+        json_path *curr = simple_vector_get(&intern->paths, json_path, i);
+
+        if (curr->status == STATUS_COLLECTING) {
+            zval zv;
+
+            if (curr->aggregate) {
+                json_path_aggregate_scalar(curr, IS_STRING, 0, 0, val, val_len);
+                continue;
+            }
+
+            if (json_path_transform_track(intern, curr, 0)) {
+                continue;
+            }
+
+            ZVAL_STR(&zv, json_path_intern(&intern->strings,
+                (const char *) val, val_len));
+
+            json_path_collected_zval(intern, curr, &zv);
+
+            if (curr->collection_stack.len == 0) {
+                curr->status = STATUS_MATCHING;
+            }
+        }
+    }
+
+    if (intern->transform) {
+        json_path_transform_after(intern);
+    }
+
+    return !EG(exception);
+}
+
+static int json_path_on_start_map(void *ctx)
+{
+    json_path_object *intern = (json_path_object *) ctx;
+    json_path_stack_elem stack_elem;
+    zend_class_entry *ce;
+    int i;
+
+    if (!json_path_top_value(intern, intern->path_stack.len)) {
+        return 0;
+    }
+
+    json_path_check_for_array_matches(intern);
+
+    if (intern->transform) {
+        json_path_transform_before(intern, 0, 0);
+    }
+
+    for (i=0; i < intern->paths.len; i++) {
+        json_path *curr = simple_vector_get(&intern->paths, json_path, i);
+
+        if (curr->status == STATUS_COLLECTING) {
+            zval zv;
+
+            if (curr->aggregate) {
+                json_path_aggregate_start(curr);
+                continue;
+            }
+
+            if (json_path_transform_track(intern, curr, 1)) {
+                continue;
+            }
+
+            if ((curr->ce || curr->class_map) &&
+                (ce = json_path_class_for(intern, curr)) != NULL) {
+                /* object_init_ex() does not run the constructor */
+                object_init_ex(&zv, ce);
+            } else if (intern->objects_as_arrays) {
+                array_init(&zv);
+            } else {
+                object_init(&zv);
+            }
+
+            simple_vector_append(&curr->collection_stack, &zv);
+        }
+    }
+
+    stack_elem.type = TYPE_OBJECT;
+    stack_elem.key = NULL;
+
+    simple_vector_append(&intern->path_stack, &stack_elem);
+
+    if (intern->transform) {
+        json_path_transform_after(intern);
+    }
+
+    return !EG(exception);
+}
+
+static int json_path_on_map_key(void *ctx, const unsigned char *val, size_t val_len)
+{
+    json_path_object *intern = (json_path_object *) ctx;
+    json_path_stack_elem *stack_elem = simple_vector_get_last(
+        &intern->path_stack, json_path_stack_elem);
+
+    json_path_check_for_array_matches(intern);
+
+    if (stack_elem->key) {
+        zend_string_release(stack_elem->key);
+    }
+
+    stack_elem->key = json_path_intern(&intern->strings, (const char *) val,
+        val_len);
+
+    json_path_check_for_matches(intern);
+
+    if (intern->transform) {
+        json_path_transform_before(intern, 1, 0);
+        json_path_transform_after(intern);
+    }
+
+    return 1;
+}
+
+static int json_path_on_end_map(void *ctx)
+{
+    json_path_object *intern = (json_path_object *) ctx;
+    json_path_stack_elem *stack_elem = simple_vector_get_last(
+        &intern->path_stack, json_path_stack_elem);
+    int i;
+
+    if (intern->transform) {
+        json_path_transform_before(intern, 0, 1);
+    }
+
+    if (stack_elem->key) {
+        zend_string_release(stack_elem->key);
+        stack_elem->key = NULL;
+    }
+
+    simple_vector_pop(&intern->path_stack);
+
+    for (i=0; i < intern->paths.len; i++) {
+        json_path *curr = simple_vector_get(&intern->paths, json_path, i);
+
+        if (curr->status == STATUS_COLLECTING) {
+            zval zv;
+
+            if (curr->aggregate) {
+                json_path_aggregate_end(curr);
+                continue;
+            }
+
+            if (json_path_transform_track(intern, curr, -1)) {
+                continue;
+            }
+
+            zv = *simple_vector_get_last(&curr->collection_stack, zval);
+            simple_vector_pop(&curr->collection_stack);
+
+            json_path_collected_zval(intern, curr, &zv);
+
+            if (curr->collection_stack.len == 0) {
+                curr->status = STATUS_MATCHING;
+            }
+        }
+    }
+
+    if (intern->transform) {
+        json_path_transform_after(intern);
+    }
+
+    return !EG(exception);
+}
+
+static int json_path_on_start_array(void *ctx)
+{
+    json_path_object *intern = (json_path_object *) ctx;
+    json_path_stack_elem stack_elem;
+    int i;
+
+    if (!json_path_top_value(intern, intern->path_stack.len)) {
+        return 0;
+    }
+
+    json_path_check_for_array_matches(intern);
+
+    if (intern->transform) {
+        json_path_transform_before(intern, 0, 0);
+    }
+
+    for (i=0; i < intern->paths.len; i++) {
+        json_path *curr = simple_vector_get(&intern->paths, json_path, i);
+
+        if (curr->status == STATUS_COLLECTING) {
+            zval zv;
+
+            if (curr->aggregate) {
+                json_path_aggregate_start(curr);
+                continue;
+            }
+
+            if (json_path_transform_track(intern, curr, 1)) {
+                continue;
+            }
+
+            /* JSON arrays are always 0..n-1, so start them packed. */
+            array_init(&zv);
+            zend_hash_real_init(Z_ARRVAL(zv), 1);
+
+            simple_vector_append(&curr->collection_stack, &zv);
+        }
+    }
+
+    stack_elem.type = TYPE_ARRAY;
+    stack_elem.index = -1;
+
+    simple_vector_append(&intern->path_stack, &stack_elem);
+
+    if (intern->transform) {
+        json_path_transform_after(intern);
+    }
+
+    return !EG(exception);
+}
+
+static int json_path_on_end_array(void *ctx)
+{
+    json_path_object *intern = (json_path_object *) ctx;
+    int i;
+
+    if (intern->transform) {
+        json_path_transform_before(intern, 0, 1);
+    }
+
+    simple_vector_pop(&intern->path_stack);
+
+    for (i=0; i < intern->paths.len; i++) {
+        json_path *curr = simple_vector_get(&intern->paths, json_path, i);
+
+        if (curr->status == STATUS_COLLECTING) {
+            zval zv;
+
+            if (curr->aggregate) {
+                json_path_aggregate_end(curr);
+                continue;
+            }
+
+            if (json_path_transform_track(intern, curr, -1)) {
+                continue;
+            }
+
+            zv = *simple_vector_get_last(&curr->collection_stack, zval);
+            simple_vector_pop(&curr->collection_stack);
+
+            json_path_collected_zval(intern, curr, &zv);
+
+            if (curr->collection_stack.len == 0) {
+                curr->status = STATUS_MATCHING;
+            }
+        }
+    }
+
+    if (intern->transform) {
+        json_path_transform_after(intern);
+    }
+
+    return !EG(exception);
+}
+
+/* A handler that ran a callback, or filled a typed property, which threw
+ * returns 0 so that the parse stops and the exception reaches the caller. */
+static yajl_callbacks json_path_yajl_callbacks = {
+    json_path_on_null,
+    json_path_on_boolean,
+    json_path_on_integer,
+    json_path_on_double,
+    NULL,
+    json_path_on_string,
+    json_path_on_start_map,
+    json_path_on_map_key,
+    json_path_on_end_map,
+    json_path_on_start_array,
+    json_path_on_end_array
+};
+
+static void json_path_profile_entry_dtor(zval *zv)
+{
+    efree(Z_PTR_P(zv));
+}
+
+static void json_path_profile_init(json_path_profile *p)
+{
+    zend_hash_init(&p->entries, 64, NULL, json_path_profile_entry_dtor, 0);
+    memset(&p->path, 0, sizeof(p->path));
+    smart_str_appendl(&p->path, "", 0);
+    simple_vector_init(&p->frames, sizeof(json_path_profile_frame));
+    p->truncated = 0;
+}
+
+static void json_path_profile_free(json_path_profile *p)
+{
+    zend_hash_destroy(&p->entries);
+    smart_str_free(&p->path);
+    simple_vector_free(&p->frames);
+}
+
+static json_path_profile_entry *json_path_profile_entry_get(
+    json_path_profile *p)
+{
+    json_path_profile_entry *entry;
+
+    entry = zend_hash_str_find_ptr(&p->entries, ZSTR_VAL(p->path.s),
+        ZSTR_LEN(p->path.s));
+
+    if (!entry) {
+        if (zend_hash_num_elements(&p->entries) >=
+            JSON_PATH_PROFILE_MAX_PATHS) {
+            p->truncated = 1;
+            return NULL;
+        }
+
+        entry = emalloc(sizeof(json_path_profile_entry));
+        entry->count = 0;
+        entry->types = 0;
+        entry->min_size = 0;
+        entry->max_size = -1;
+        zend_hash_str_add_new_ptr(&p->entries, ZSTR_VAL(p->path.s),
+            ZSTR_LEN(p->path.s), entry);
+    }
+
+    return entry;
+}
+
+static void json_path_profile_size(json_path_profile_entry *entry,
+    zend_long size)
+{
+    if (entry->max_size < 0 || size < entry->min_size) {
+        entry->min_size = size;
+    }
+
+    if (size > entry->max_size) {
+        entry->max_size = size;
+    }
+}
+
+/* Records a value at the current path. Array elements all share one
+ * path, so its entry is looked up once per array. */
+static json_path_profile_entry *json_path_profile_value(
+    json_path_object *intern, int type, zend_long size)
+{
+    json_path_profile *p = intern->profile;
+    json_path_profile_frame *frame = NULL;
+    json_path_profile_entry *entry;
+
+    if (p->frames.len > 0) {
+        frame = simple_vector_get_last(&p->frames, json_path_profile_frame);
+    }
+
+    if (frame && frame->is_array) {
+        frame->size++;
+        if (!frame->elements) {
+            frame->elements = json_path_profile_entry_get(p);
+        }
+        entry = frame->elements;
+    } else {
+        entry = json_path_profile_entry_get(p);
+    }
+
+    if (entry) {
+        entry->count++;
+        entry->types |= type;
+        if (size >= 0) {
+            json_path_profile_size(entry, size);
+        }
+    }
+
+    return entry;
+}
+
+/* Paths stay string keys, so a path like "0" is not turned into an
+ * integer key */
+static void json_path_profile_result(json_path_profile *p, zval *rv)
+{
+    json_path_profile_entry *entry;
+    zend_string *path;
+
+    array_init_size(rv, zend_hash_num_elements(&p->entries));
+
+    ZEND_HASH_FOREACH_STR_KEY_PTR(&p->entries, path, entry) {
+        zval info, types;
+        int i;
+
+        array_init_size(&info, 4);
+        array_init(&types);
+
+        for (i=0; i < (int) (sizeof(json_path_profile_type_names) /
+            sizeof(json_path_profile_type_names[0])); i++) {
+            if (entry->types & (1 << i)) {
+                add_next_index_string(&types, json_path_profile_type_names[i]);
+            }
+        }
+
+        add_assoc_long(&info, "count", entry->count);
+        add_assoc_zval(&info, "types", &types);
+        if (entry->max_size < 0) {
+            add_assoc_null(&info, "min_size");
+            add_assoc_null(&info, "max_size");
+        } else {
+            add_assoc_long(&info, "min_size", entry->min_size);
+            add_assoc_long(&info, "max_size", entry->max_size);
+        }
+
+        zend_hash_update(Z_ARRVAL_P(rv), path, &info);
+    } ZEND_HASH_FOREACH_END();
+}
+
+/* profile() summarizes every normalized path: array indexes collapse to
+ * [*], so memory grows with the number of distinct paths, not with the
+ * document. Documents that use object keys as data can still produce
+ * unbounded paths, so tracking stops at JSON_PATH_PROFILE_MAX_PATHS. */
+static int json_path_profile_scalar(json_path_object *intern, int type,
+    zend_long size)
+{
+    if (!json_path_top_value(intern, intern->profile->frames.len)) {
+        return 0;
+    }
+
+    json_path_profile_value(intern, type, size);
+
+    return 1;
+}
+
+static int json_path_profile_on_null(void *ctx)
+{
+    return json_path_profile_scalar((json_path_object *) ctx,
+        JSON_PATH_PROFILE_NULL, -1);
+}
+
+static int json_path_profile_on_boolean(void *ctx, int val)
+{
+    return json_path_profile_scalar((json_path_object *) ctx,
+        JSON_PATH_PROFILE_BOOLEAN, -1);
+}
+
+static int json_path_profile_on_integer(void *ctx, long long val)
+{
+    return json_path_profile_scalar((json_path_object *) ctx,
+        JSON_PATH_PROFILE_INTEGER, -1);
+}
+
+static int json_path_profile_on_double(void *ctx, double val)
+{
+    return json_path_profile_scalar((json_path_object *) ctx,
+        JSON_PATH_PROFILE_FLOAT, -1);
+}
+
+static int json_path_profile_on_string(void *ctx, const unsigned char *val,
+    size_t val_len)
+{
+    return json_path_profile_scalar((json_path_object *) ctx,
+        JSON_PATH_PROFILE_STRING, (zend_long) val_len);
+}
+
+static int json_path_profile_push(json_path_object *intern, int type)
+{
+    json_path_profile *p = intern->profile;
+    json_path_profile_frame frame;
+
+    if (!json_path_top_value(intern, p->frames.len)) {
+        return 0;
+    }
+
+    frame.entry = json_path_profile_value(intern, type, -1);
+    frame.base = ZSTR_LEN(p->path.s);
+    frame.is_array = (type == JSON_PATH_PROFILE_ARRAY);
+    frame.size = 0;
+    frame.elements = NULL;
+
+    simple_vector_append(&p->frames, &frame);
+
+    if (frame.is_array) {
+        smart_str_appendl(&p->path, "[*]", sizeof("[*]")-1);
+    }
+
+    return 1;
+}
+
+static void json_path_profile_pop(json_path_object *intern)
+{
+    json_path_profile *p = intern->profile;
+    json_path_profile_frame *frame = simple_vector_get_last(&p->frames,
+        json_path_profile_frame);
+
+    if (frame->entry) {
+        json_path_profile_size(frame->entry, frame->size);
+    }
+
+    ZSTR_LEN(p->path.s) = frame->base;
+    simple_vector_pop(&p->frames);
+}
+
+static int json_path_profile_on_start_map(void *ctx)
+{
+    return json_path_profile_push((json_path_object *) ctx,
+        JSON_PATH_PROFILE_OBJECT);
+}
+
+static int json_path_profile_on_map_key(void *ctx, const unsigned char *val,
+    size_t val_len)
+{
+    json_path_profile *p = ((json_path_object *) ctx)->profile;
+    json_path_profile_frame *frame = simple_vector_get_last(&p->frames,
+        json_path_profile_frame);
+
+    frame->size++;
+
+    ZSTR_LEN(p->path.s) = frame->base;
+    if (frame->base > 0) {
+        smart_str_appendc(&p->path, '.');
+    }
+    smart_str_appendl(&p->path, (const char *) val, val_len);
+
+    return 1;
+}
+
+static int json_path_profile_on_end_map(void *ctx)
+{
+    json_path_profile_pop((json_path_object *) ctx);
+    return 1;
+}
+
+static int json_path_profile_on_start_array(void *ctx)
+{
+    return json_path_profile_push((json_path_object *) ctx,
+        JSON_PATH_PROFILE_ARRAY);
+}
+
+static int json_path_profile_on_end_array(void *ctx)
+{
+    json_path_profile_pop((json_path_object *) ctx);
+    return 1;
+}
+
+static yajl_callbacks json_path_profile_yajl_callbacks = {
+    json_path_profile_on_null,
+    json_path_profile_on_boolean,
+    json_path_profile_on_integer,
+    json_path_profile_on_double,
+    NULL,
+    json_path_profile_on_string,
+    json_path_profile_on_start_map,
+    json_path_profile_on_map_key,
+    json_path_profile_on_end_map,
+    json_path_profile_on_start_array,
+    json_path_profile_on_end_array
+};
+
+static void * json_path_yajl_malloc(void *ctx, size_t sz)
+{
+    return emalloc(sz);
+}
+
+static void json_path_yajl_free(void *ctx, void *ptr)
+{
+    efree(ptr);
+}
+
+static void * json_path_yajl_realloc(void *ctx, void *ptr, size_t sz)
+{
+    return erealloc(ptr, sz);
+}
+
+static yajl_alloc_funcs json_path_yajl_alloc_funcs = {
+    json_path_yajl_malloc,
+    json_path_yajl_realloc,
+    json_path_yajl_free,
+    NULL
+};
+
+/* Compressed input is recognised by its magic bytes and inflated into
+ * large buffers that go straight to the tokenizer. Plain JSON is passed
+ * through without copying. The decoder only uses the system allocator
+ * and never raises PHP errors itself, so it may run off the PHP thread. */
+static int json_path_decoder_emit(json_path_decoder *d,
+    const unsigned char *buf, size_t len)
+{
+    d->emitted += len;
+    return d->sink(d->sink_ctx, buf, len);
+}
+
+/* With an output limit set, a write stops once it has emitted that much
+ * and keeps the input it has not consumed for json_path_decoder_resume().
+ * The caller keeps that input alive until then. */
+static int json_path_decoder_pause(json_path_decoder *d,
+    const unsigned char *rest, size_t rest_len)
+{
+    if (!d->out_limit || d->emitted < d->out_limit) {
+        return 0;
+    }
+
+    d->rest = rest;
+    d->rest_len = rest_len;
+    d->paused = 1;
+
+    return 1;
+}
+
+static void json_path_decoder_init(json_path_decoder *d, json_path_sink sink,
+    void *sink_ctx)
+{
+    memset(d, 0, sizeof(*d));
+    d->encoding = ENCODING_DETECT;
+    d->sink = sink;
+    d->sink_ctx = sink_ctx;
+}
+
+static void json_path_decoder_free(json_path_decoder *d)
+{
+#ifdef HAVE_JSON_PATH_ZLIB
+    if (d->encoding == ENCODING_GZIP) {
+        inflateEnd(&d->zs);
+    }
+#endif
+#ifdef HAVE_JSON_PATH_ZSTD
+    if (d->zds) {
+        ZSTD_freeDStream(d->zds);
+        d->zds = NULL;
+    }
+#endif
+    if (d->out) {
+        pefree(d->out, 1);
+        d->out = NULL;
+    }
+    d->encoding = ENCODING_DETECT;
+}
+
+static int json_path_decoder_select(json_path_decoder *d,
+    const unsigned char *magic, size_t magic_len)
+{
+    if (magic_len >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+#ifdef HAVE_JSON_PATH_ZLIB
+        /* 15+32: any window size, gzip or zlib header */
+        if (inflateInit2(&d->zs, 15 + 32) != Z_OK) {
+            d->error = "Failed initializing gzip decompression";
+            return 0;
+        }
+        d->encoding = ENCODING_GZIP;
+#else
+        d->error = "gzip input is not supported by this build";
+        return 0;
+#endif
+    } else if (magic_len >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 &&
+        magic[2] == 0x2f && magic[3] == 0xfd) {
+#ifdef HAVE_JSON_PATH_ZSTD
+        d->zds = ZSTD_createDStream();
+        if (!d->zds || ZSTD_isError(ZSTD_initDStream(d->zds))) {
+            d->error = "Failed initializing zstd decompression";
+            return 0;
+        }
+        d->encoding = ENCODING_ZSTD;
+#else
+        d->error = "zstd input is not supported by this build";
+        return 0;
+#endif
+    } else {
+        d->encoding = ENCODING_NONE;
+        return 1;
+    }
+
+    d->out_size = d->out_limit ? MIN(d->out_limit,
+        JSON_PATH_DECODE_BUFFER_SIZE) : JSON_PATH_DECODE_BUFFER_SIZE;
+    d->out = pemalloc(d->out_size, 1);
+
+    return 1;
+}
+
+#ifdef HAVE_JSON_PATH_ZLIB
+static int json_path_decoder_inflate(json_path_decoder *d,
+    const unsigned char *buf, size_t len)
+{
+    const unsigned char *end = buf + len;
+    int ret;
+
+    d->zs.next_in = (Bytef *) buf;
+
+    do {
+        /* avail_in is a uInt, so very large strings go in slices */
+        len = end - d->zs.next_in;
+        d->zs.avail_in = len > (1U << 30) ? (1U << 30) : (uInt) len;
+        d->zs.next_out = d->out;
+        d->zs.avail_out = d->out_size;
+
+        ret = inflate(&d->zs, Z_NO_FLUSH);
+
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+            d->error = "Failed decompressing gzip input";
+            return 0;
+        }
+
+        if (d->zs.avail_out < d->out_size && !json_path_decoder_emit(d,
+            d->out, d->out_size - d->zs.avail_out)) {
+            return 0;
+        }
+
+        d->finished = 0;
+        if (ret == Z_STREAM_END) {
+            /* Concatenated members, as written by pigz and friends */
+            d->finished = 1;
+            if (d->zs.next_in == end) {
+                break;
+            }
+            inflateReset(&d->zs);
+        }
+    } while ((d->zs.next_in < end || d->zs.avail_out == 0) &&
+        !json_path_decoder_pause(d, d->zs.next_in, end - d->zs.next_in));
+
+    return 1;
+}
+#endif
+
+#ifdef HAVE_JSON_PATH_ZSTD
+static int json_path_decoder_unzstd(json_path_decoder *d,
+    const unsigned char *buf, size_t len)
+{
+    ZSTD_inBuffer in;
+    ZSTD_outBuffer out;
+    size_t ret;
+
+    in.src = buf;
+    in.size = len;
+    in.pos = 0;
+
+    do {
+        out.dst = d->out;
+        out.size = d->out_size;
+        out.pos = 0;
+
+        ret = ZSTD_decompressStream(d->zds, &out, &in);
+
+        if (ZSTD_isError(ret)) {
+            d->error = "Failed decompressing zstd input";
+            return 0;
+        }
+
+        if (out.pos && !json_path_decoder_emit(d, d->out, out.pos)) {
+            return 0;
+        }
+
+        d->finished = (ret == 0);
+    } while ((in.pos < in.size || out.pos == out.size) &&
+        !json_path_decoder_pause(d, buf + in.pos, len - in.pos));
+
+    return 1;
+}
+#endif
+
+static int json_path_decoder_write(json_path_decoder *d,
+    const unsigned char *buf, size_t len)
+{
+    d->emitted = 0;
+
+    switch (d->encoding) {
+#ifdef HAVE_JSON_PATH_ZLIB
+        case ENCODING_GZIP:
+            return json_path_decoder_inflate(d, buf, len);
+#endif
+#ifdef HAVE_JSON_PATH_ZSTD
+        case ENCODING_ZSTD:
+            return json_path_decoder_unzstd(d, buf, len);
+#endif
+        default:
+            return json_path_decoder_emit(d, buf, len);
+    }
+}
+
+static int json_path_decoder_feed(json_path_decoder *d,
+    const unsigned char *buf, size_t len)
+{
+    size_t n;
+
+    if (d->encoding != ENCODING_DETECT) {
+        return len == 0 || json_path_decoder_write(d, buf, len);
+    }
+
+    if (d->magic_len == 0 && len >= sizeof(d->magic)) {
+        return json_path_decoder_select(d, buf, len) &&
+            json_path_decoder_write(d, buf, len);
+    }
+
+    n = MIN(sizeof(d->magic) - d->magic_len, len);
+    memcpy(d->magic + d->magic_len, buf, n);
+    d->magic_len += n;
+
+    if (d->magic_len < sizeof(d->magic)) {
+        return 1;
+    }
+
+    return json_path_decoder_select(d, d->magic, d->magic_len) &&
+        json_path_decoder_write(d, d->magic, d->magic_len) &&
+        (len == n || json_path_decoder_write(d, buf + n, len - n));
+}
+
+/* Continues a write that json_path_decoder_pause() stopped */
+static int json_path_decoder_resume(json_path_decoder *d)
+{
+    d->paused = 0;
+
+    return json_path_decoder_write(d, d->rest, d->rest_len);
+}
+
+static int json_path_decoder_finish(json_path_decoder *d)
+{
+    if (d->encoding == ENCODING_DETECT) {
+        if (!json_path_decoder_select(d, d->magic, d->magic_len) ||
+            (d->magic_len && !json_path_decoder_write(d, d->magic,
+            d->magic_len))) {
+            return 0;
+        }
+    }
+
+    if ((d->encoding == ENCODING_GZIP || d->encoding == ENCODING_ZSTD) &&
+        !d->finished) {
+        d->error = "Unexpected end of compressed input";
+        return 0;
+    }
+
+    return 1;
+}
+
+/* CBOR and MessagePack input: push decoders that drive the same
+ * callbacks as the JSON tokenizer, so matching and collection work
+ * unchanged. Items split across chunks wait in carry until complete. */
+static inline uint64_t json_path_read_be(const unsigned char *p, size_t n)
+{
+    uint64_t v = 0;
+    size_t i;
+
+    for (i=0; i < n; i++) {
+        v = (v << 8) | p[i];
+    }
+
+    return v;
+}
+
+static double json_path_half_float(uint16_t h)
+{
+    int exp = (h >> 10) & 0x1f, mant = h & 0x3ff;
+    double v;
+
+    if (exp == 0) {
+        v = ldexp(mant, -24);
+    } else if (exp != 31) {
+        v = ldexp(mant + 1024, exp - 25);
+    } else {
+        v = mant == 0 ? INFINITY : NAN;
+    }
+
+    return (h & 0x8000) ? -v : v;
+}
+
+static inline yajl_callbacks *json_path_binary_callbacks(
+    json_path_object *intern)
+{
+    return intern->profile ? &json_path_profile_yajl_callbacks :
+        &json_path_yajl_callbacks;
+}
+
+static inline json_path_binary_frame *json_path_binary_top(
+    json_path_binary *b)
+{
+    return b->frames.len > 0 ? simple_vector_get_last(&b->frames,
+        json_path_binary_frame) : NULL;
+}
+
+static int json_path_binary_fail(json_path_binary *b, const char *error)
+{
+    if (!b->error) {
+        b->error = error;
+    }
+
+    return 0;
+}
+
+/* Called before a value: rejects anything after the top-level value */
+static inline int json_path_binary_value(json_path_binary *b)
+{
+    if (b->done) {
+        return json_path_binary_fail(b,
+            "Trailing data after the top-level value");
+    }
+
+    return 1;
+}
+
+/* A value is complete: counts it against its container and closes every
+ * container that this completes */
+static int json_path_binary_complete(json_path_object *intern)
+{
+    json_path_binary *b = &intern->binary;
+    json_path_binary_frame *top;
+
+    while ((top = json_path_binary_top(b)) != NULL) {
+        if (top->is_map) {
+            top->expect_key = 1;
+        }
+
+        if (top->remaining < 0 || --top->remaining > 0) {
+            return 1;
+        }
+
+        simple_vector_pop(&b->frames);
+
+        if (!(top->is_map ?
+            json_path_binary_callbacks(intern)->yajl_end_map(intern) :
+            json_path_binary_callbacks(intern)->yajl_end_array(intern))) {
+            return json_path_binary_fail(b, "Parsing was cancelled");
+        }
+    }
+
+    b->done = 1;
+
+    return 1;
+}
+
+static inline int json_path_binary_expects_key(json_path_binary *b)
+{
+    json_path_binary_frame *top = json_path_binary_top(b);
+
+    return top && top->is_map && top->expect_key;
+}
+
+static int json_path_binary_key(json_path_object *intern,
+    const unsigned char *val, size_t val_len)
+{
+    json_path_binary_top(&intern->binary)->expect_key = 0;
+
+    if (!json_path_binary_callbacks(intern)->yajl_map_key(intern, val,
+        val_len)) {
+        return json_path_binary_fail(&intern->binary, "Parsing was cancelled");
+    }
+
+    return 1;
+}
+
+static int json_path_binary_string(json_path_object *intern,
+    const unsigned char *val, size_t val_len)
+{
+    if (json_path_binary_expects_key(&intern->binary)) {
+        return json_path_binary_key(intern, val, val_len);
+    }
+
+    if (!json_path_binary_value(&intern->binary)) {
+        return 0;
+    }
+
+    if (!json_path_binary_callbacks(intern)->yajl_string(intern, val,
+        val_len)) {
+        return json_path_binary_fail(&intern->binary, "Parsing was cancelled");
+    }
+
+    return json_path_binary_complete(intern);
+}
+
+/* Integer keys are passed on as their decimal string, like PHP arrays
+ * would show them */
+static int json_path_binary_integer(json_path_object *intern, int64_t val)
+{
+    if (json_path_binary_expects_key(&intern->binary)) {
+        char buf[24];
+        int len = snprintf(buf, sizeof(buf), "%lld", (long long) val);
+
+        return json_path_binary_key(intern, (const unsigned char *) buf, len);
+    }
+
+    if (!json_path_binary_value(&intern->binary)) {
+        return 0;
+    }
+
+    if (!json_path_binary_callbacks(intern)->yajl_integer(intern,
+        (long long) val)) {
+        return json_path_binary_fail(&intern->binary, "Parsing was cancelled");
+    }
+
+    return json_path_binary_complete(intern);
+}
+
+/* null, booleans and doubles; type is IS_NULL, IS_FALSE, IS_TRUE or
+ * IS_DOUBLE */
+static int json_path_binary_scalar(json_path_object *intern, int type,
+    double val)
+{
+    yajl_callbacks *cb = json_path_binary_callbacks(intern);
+    int ok;
+
+    if (json_path_binary_expects_key(&intern->binary)) {
+        return json_path_binary_fail(&intern->binary,
+            "Unsupported map key type");
+    }
+
+    if (!json_path_binary_value(&intern->binary)) {
+        return 0;
+    }
+
+    switch (type) {
+        case IS_NULL:
+            ok = cb->yajl_null(intern);
+            break;
+        case IS_FALSE:
+        case IS_TRUE:
+            ok = cb->yajl_boolean(intern, type == IS_TRUE);
+            break;
+        default:
+            ok = cb->yajl_double(intern, val);
+            break;
+    }
+
+    if (!ok) {
+        return json_path_binary_fail(&intern->binary, "Parsing was cancelled");
+    }
+
+    return json_path_binary_complete(intern);
+}
+
+static int json_path_binary_uint(json_path_object *intern, uint64_t val)
+{
+    if (val > (uint64_t) INT64_MAX) {
+        if (json_path_binary_expects_key(&intern->binary)) {
+            return json_path_binary_fail(&intern->binary,
+                "Unsupported map key type");
+        }
+        return json_path_binary_scalar(intern, IS_DOUBLE, (double) val);
+    }
+
+    return json_path_binary_integer(intern, (int64_t) val);
+}
+
+/* remaining is the number of elements or pairs, -1 when indefinite */
+static int json_path_binary_start(json_path_object *intern, int is_map,
+    int64_t remaining)
+{
+    json_path_binary *b = &intern->binary;
+    yajl_callbacks *cb = json_path_binary_callbacks(intern);
+    json_path_binary_frame frame;
+
+    if (json_path_binary_expects_key(b)) {
+        return json_path_binary_fail(b, "Unsupported map key type");
+    }
+
+    if (!json_path_binary_value(b)) {
+        return 0;
+    }
+
+    if (!(is_map ? cb->yajl_start_map(intern) : cb->yajl_start_array(intern))) {
+        return json_path_binary_fail(b, "Parsing was cancelled");
+    }
+
+    if (remaining == 0) {
+        if (!(is_map ? cb->yajl_end_map(intern) : cb->yajl_end_array(intern))) {
+            return json_path_binary_fail(b, "Parsing was cancelled");
+        }
+        return json_path_binary_complete(intern);
+    }
+
+    frame.is_map = is_map;
+    frame.expect_key = is_map;
+    frame.remaining = remaining;
+    simple_vector_append(&b->frames, &frame);
+
+    return 1;
+}
+
+/* Ends the innermost indefinite-length container */
+static int json_path_binary_end(json_path_object *intern)
+{
+    json_path_binary *b = &intern->binary;
+    yajl_callbacks *cb = json_path_binary_callbacks(intern);
+    json_path_binary_frame *top = json_path_binary_top(b);
+
+    if (!top || top->remaining >= 0 || (top->is_map && !top->expect_key)) {
+        return json_path_binary_fail(b, "Unexpected end of a container");
+    }
+
+    simple_vector_pop(&b->frames);
+
+    if (!(top->is_map ? cb->yajl_end_map(intern) :
+        cb->yajl_end_array(intern))) {
+        return json_path_binary_fail(b, "Parsing was cancelled");
+    }
+
+    /* the closed container is a complete value of its parent */
+    return json_path_binary_complete(intern);
+}
+
+/* CBOR break: ends an indefinite-length container or string */
+static int json_path_cbor_break(json_path_object *intern)
+{
+    json_path_binary *b = &intern->binary;
+    int ok;
+
+    if (b->chunks_major) {
+        b->chunks_major = 0;
+        if (!b->chunks.s) {
+            return json_path_binary_string(intern,
+                (const unsigned char *) "", 0);
+        }
+        ok = json_path_binary_string(intern,
+            (const unsigned char *) ZSTR_VAL(b->chunks.s),
+            ZSTR_LEN(b->chunks.s));
+        ZSTR_LEN(b->chunks.s) = 0;
+        return ok;
+    }
+
+    return json_path_binary_end(intern);
+}
+
+/* An item whose payload is not all there yet: returns 0 and notes how
+ * long the item is, so that feeding waits for that many bytes instead of
+ * decoding it again with every chunk. */
+static inline ssize_t json_path_binary_wait(json_path_binary *b,
+    size_t head, uint64_t payload)
+{
+    b->need = payload > SIZE_MAX - head ? SIZE_MAX : head + payload;
+    return 0;
+}
+
+/* Decodes one CBOR item. Returns the bytes it took, 0 when it is not
+ * complete yet and -1 on error. Tags are skipped; the tagged item
+ * follows as the value. */
+static ssize_t json_path_cbor_item(json_path_object *intern,
+    const unsigned char *p, size_t avail)
+{
+    json_path_binary *b = &intern->binary;
+    int major = p[0] >> 5, ai = p[0] & 0x1f;
+    size_t head = 1;
+    uint64_t val = 0;
+    int ok = 1;
+
+    if (ai < 24) {
+        val = ai;
+    } else if (ai <= 27) {
+        head += (size_t) 1 << (ai - 24);
+        if (avail < head) {
+            return 0;
+        }
+        val = json_path_read_be(p + 1, head - 1);
+    } else if (ai != 31 || major == 0 || major == 1 || major == 6) {
+        json_path_binary_fail(b, "Malformed CBOR input");
+        return -1;
+    }
+
+    /* inside an indefinite-length string only its chunks may follow */
+    if (b->chunks_major && p[0] != 0xff &&
+        (major != b->chunks_major || ai == 31)) {
+        json_path_binary_fail(b, "Malformed CBOR input");
+        return -1;
+    }
+
+    switch (major) {
+        case 0:
+            ok = json_path_binary_uint(intern, val);
+            break;
+        case 1:
+            if (val > (uint64_t) INT64_MAX) {
+                ok = json_path_binary_expects_key(b) ?
+                    json_path_binary_fail(b, "Unsupported map key type") :
+                    json_path_binary_scalar(intern, IS_DOUBLE,
+                    -1.0 - (double) val);
+            } else {
+                ok = json_path_binary_integer(intern, -1 - (int64_t) val);
+            }
+            break;
+        case 2:
+        case 3:
+            if (ai == 31) {
+                b->chunks_major = major;
+                if (b->chunks.s) {
+                    ZSTR_LEN(b->chunks.s) = 0;
+                }
+                break;
+            }
+            if (val > avail - head) {
+                return json_path_binary_wait(b, head, val);
+            }
+            if (b->chunks_major) {
+                smart_str_appendl(&b->chunks, (const char *) p + head, val);
+            } else {
+                ok = json_path_binary_string(intern, p + head, val);
+            }
+            head += val;
+            break;
+        case 4:
+        case 5:
+            if (ai != 31 && val > (uint64_t) INT64_MAX) {
+                json_path_binary_fail(b, "Malformed CBOR input");
+                return -1;
+            }
+            ok = json_path_binary_start(intern, major == 5,
+                ai == 31 ? -1 : (int64_t) val);
+            break;
+        case 6:
+            break;
+        default:
+            switch (ai) {
+                case 20:
+                case 21:
+                    ok = json_path_binary_scalar(intern,
+                        ai == 21 ? IS_TRUE : IS_FALSE, 0);
+                    break;
+                case 25:
+                    ok = json_path_binary_scalar(intern, IS_DOUBLE,
+                        json_path_half_float((uint16_t) val));
+                    break;
+                case 26: {
+                    uint32_t bits = (uint32_t) val;
+                    float f;
+
+                    memcpy(&f, &bits, sizeof(f));
+                    ok = json_path_binary_scalar(intern, IS_DOUBLE, f);
+                    break;
+                }
+                case 27: {
+                    double d;
+
+                    memcpy(&d, &val, sizeof(d));
+                    ok = json_path_binary_scalar(intern, IS_DOUBLE, d);
+                    break;
+                }
+                case 31:
+                    ok = json_path_cbor_break(intern);
+                    break;
+                default:
+                    /* null, undefined and unassigned simple values */
+                    ok = json_path_binary_scalar(intern, IS_NULL, 0);
+                    break;
+            }
+            break;
+    }
+
+    return ok ? (ssize_t) head : -1;
+}
+
+/* Reads an n-byte length after the type byte into *len */
+#define JSON_PATH_MSGPACK_LENGTH(n) \
+    if (avail < 1 + (n)) { \
+        return 0; \
+    } \
+    len = json_path_read_be(p + 1, (n)); \
+    head = 1 + (n);
+
+/* Decodes one MessagePack item, with the same contract as
+ * json_path_cbor_item(). Extension types become null. */
+static ssize_t json_path_msgpack_item(json_path_object *intern,
+    const unsigned char *p, size_t avail)
+{
+    json_path_binary *b = &intern->binary;
+    unsigned char c = p[0];
+    size_t head = 1;
+    uint64_t len = 0;
+    int ok;
+
+    if (c <= 0x7f) {
+        ok = json_path_binary_integer(intern, c);
+    } else if (c >= 0xe0) {
+        ok = json_path_binary_integer(intern, (int8_t) c);
+    } else if (c <= 0x8f) {
+        ok = json_path_binary_start(intern, 1, c & 0x0f);
+    } else if (c <= 0x9f) {
+        ok = json_path_binary_start(intern, 0, c & 0x0f);
+    } else if (c <= 0xbf) {
+        len = c & 0x1f;
+        if (len > avail - head) {
+            return json_path_binary_wait(b, head, len);
+        }
+        ok = json_path_binary_string(intern, p + head, len);
+        head += len;
+    } else {
+        switch (c) {
+            case 0xc0:
+                ok = json_path_binary_scalar(intern, IS_NULL, 0);
+                break;
+            case 0xc2:
+            case 0xc3:
+                ok = json_path_binary_scalar(intern,
+                    c == 0xc3 ? IS_TRUE : IS_FALSE, 0);
+                break;
+            case 0xc4: case 0xc5: case 0xc6:
+            case 0xd9: case 0xda: case 0xdb:
+                if (c <= 0xc6) {
+                    JSON_PATH_MSGPACK_LENGTH((size_t) 1 << (c - 0xc4));
+                } else {
+                    JSON_PATH_MSGPACK_LENGTH((size_t) 1 << (c - 0xd9));
+                }
+                if (len > avail - head) {
+                    return json_path_binary_wait(b, head, len);
+                }
+                ok = json_path_binary_string(intern, p + head, len);
+                head += len;
+                break;
+            case 0xc7: case 0xc8: case 0xc9:
+                JSON_PATH_MSGPACK_LENGTH((size_t) 1 << (c - 0xc7));
+                if (len + 1 > avail - head) {
+                    return json_path_binary_wait(b, head + 1, len);
+                }
+                ok = json_path_binary_scalar(intern, IS_NULL, 0);
+                head += len + 1;
+                break;
+            case 0xd4: case 0xd5: case 0xd6: case 0xd7: case 0xd8:
+                head += 1 + ((size_t) 1 << (c - 0xd4));
+                if (avail < head) {
+                    return 0;
+                }
+                ok = json_path_binary_scalar(intern, IS_NULL, 0);
+                break;
+            case 0xca: {
+                uint32_t bits;
+                float f;
+
+                JSON_PATH_MSGPACK_LENGTH(4);
+                bits = (uint32_t) len;
+                memcpy(&f, &bits, sizeof(f));
+                ok = json_path_binary_scalar(intern, IS_DOUBLE, f);
+                break;
+            }
+            case 0xcb: {
+                double d;
+
+                JSON_PATH_MSGPACK_LENGTH(8);
+                memcpy(&d, &len, sizeof(d));
+                ok = json_path_binary_scalar(intern, IS_DOUBLE, d);
+                break;
+            }
+            case 0xcc: case 0xcd: case 0xce: case 0xcf:
+                JSON_PATH_MSGPACK_LENGTH((size_t) 1 << (c - 0xcc));
+                ok = json_path_binary_uint(intern, len);
+                break;
+            case 0xd0:
+                JSON_PATH_MSGPACK_LENGTH(1);
+                ok = json_path_binary_integer(intern, (int8_t) len);
+                break;
+            case 0xd1:
+                JSON_PATH_MSGPACK_LENGTH(2);
+                ok = json_path_binary_integer(intern, (int16_t) len);
+                break;
+            case 0xd2:
+                JSON_PATH_MSGPACK_LENGTH(4);
+                ok = json_path_binary_integer(intern, (int32_t) len);
+                break;
+            case 0xd3:
+                JSON_PATH_MSGPACK_LENGTH(8);
+                ok = json_path_binary_integer(intern, (int64_t) len);
+                break;
+            case 0xdc: case 0xdd: case 0xde: case 0xdf:
+                JSON_PATH_MSGPACK_LENGTH((size_t) 2 << ((c - 0xdc) & 1));
+                ok = json_path_binary_start(intern, c >= 0xde, (int64_t) len);
+                break;
+            default:
+                ok = json_path_binary_fail(b, "Malformed MessagePack input");
+                break;
+        }
+    }
+
+    return ok ? (ssize_t) head : -1;
+}
+
+static int json_path_binary_feed(json_path_object *intern,
+    const unsigned char *buf, size_t len)
+{
+    json_path_binary *b = &intern->binary;
+    const unsigned char *p = buf;
+    size_t avail = len;
+    int carried = b->carry.s && ZSTR_LEN(b->carry.s) > 0;
+    ssize_t used;
+
+    if (carried) {
+        size_t have = ZSTR_LEN(b->carry.s);
+
+        /* grow towards the pending item's length geometrically */
+        if (b->need > have && have + len > b->carry.a) {
+            smart_str_alloc(&b->carry, MIN(b->need - have, MAX(len, have)),
+                0);
+        }
+        smart_str_appendl(&b->carry, (const char *) buf, len);
+
+        if (ZSTR_LEN(b->carry.s) < b->need) {
+            return 1;
+        }
+
+        p = (const unsigned char *) ZSTR_VAL(b->carry.s);
+        avail = ZSTR_LEN(b->carry.s);
+    }
+
+    while (avail > 0) {
+        b->need = 0;
+        used = intern->format == JSON_PATH_FORMAT_CBOR ?
+            json_path_cbor_item(intern, p, avail) :
+            json_path_msgpack_item(intern, p, avail);
+
+        if (used < 0) {
+            return 0;
+        }
+
+        if (used == 0) {
+            break;
+        }
+
+        p += used;
+        avail -= used;
+    }
+
+    if (carried) {
+        memmove(ZSTR_VAL(b->carry.s), p, avail);
+        ZSTR_LEN(b->carry.s) = avail;
+    } else if (avail > 0) {
+        smart_str_appendl(&b->carry, (const char *) p, avail);
+    }
+
+    return 1;
+}
+
+static int json_path_binary_finish(json_path_object *intern)
+{
+    json_path_binary *b = &intern->binary;
+
+    if (!b->done || b->frames.len > 0 || b->chunks_major ||
+        (b->carry.s && ZSTR_LEN(b->carry.s) > 0)) {
+        return json_path_binary_fail(b, "Unexpected end of input");
+    }
+
+    return 1;
+}
+
+static void json_path_binary_reset(json_path_binary *b)
+{
+    b->frames.len = 0;
+    b->chunks_major = 0;
+    b->need = 0;
+    b->done = 0;
+    b->error = NULL;
+
+    if (b->carry.s) {
+        ZSTR_LEN(b->carry.s) = 0;
+    }
+}
+
+static int json_path_feed_tokenizer(void *ctx, const unsigned char *buf,
+    size_t len)
+{
+    json_path_object *intern = (json_path_object *) ctx;
+    json_path_transform *t = intern->transform;
+
+    if (intern->format != JSON_PATH_FORMAT_JSON) {
+        return json_path_binary_feed(intern, buf, len);
+    }
+
+    if (!t) {
+        return yajl_parse(intern->yh, buf, len) == yajl_status_ok;
+    }
+
+    /* transform() buffers what it has not written yet, so keep the
+     * slices small enough for that to stay bounded */
+    while (len > 0) {
+        size_t n = MIN(len, JSON_PATH_READ_BUFFER_SIZE);
+
+        json_path_transform_input(t, buf, n);
+
+        if (yajl_parse(intern->yh, buf, n) != yajl_status_ok || t->failed) {
+            return 0;
+        }
+
+        buf += n;
+        len -= n;
+    }
+
+    return 1;
+}
+
+/* The handle of the matching tokenizer is kept after a successful parse
+ * and reused by the next one, so small documents skip yajl_alloc(). The
+ * profiler has its own callbacks and always gets a fresh handle. */
+static void json_path_parse_begin(json_path_object *intern)
+{
+    if (intern->format != JSON_PATH_FORMAT_JSON) {
+        json_path_binary_reset(&intern->binary);
+        intern->yh = NULL;
+    } else if (intern->pool && !intern->profile) {
+        intern->yh = intern->pool;
+        intern->pool = NULL;
+    } else {
+        intern->yh = yajl_alloc(intern->profile ?
+            &json_path_profile_yajl_callbacks : &json_path_yajl_callbacks,
+            &json_path_yajl_alloc_funcs, (void *) intern);
+        yajl_config(intern->yh, yajl_allow_multiple_values, 1);
+    }
+
+    json_path_values_begin(intern);
+
+    json_path_decoder_init(&intern->decoder, json_path_feed_tokenizer,
+        intern);
+}
+
+static void json_path_parse_cleanup(json_path_object *intern)
+{
+    json_path_decoder_free(&intern->decoder);
+
+    if (intern->yh) {
+        yajl_free(intern->yh);
+        intern->yh = NULL;
+    }
+}
+
+/* Like json_path_parse_cleanup(), but after a complete document, when the
+ * handle is in a state the next parse can start from */
+static void json_path_parse_release(json_path_object *intern)
+{
+    json_path_decoder_free(&intern->decoder);
+
+    if (!intern->yh) {
+        return;
+    }
+
+    if (!intern->profile && !intern->pool) {
+        intern->pool = intern->yh;
+    } else {
+        yajl_free(intern->yh);
+    }
+
+    intern->yh = NULL;
+}
+
+static int json_path_parse_failed(json_path_object *intern)
+{
+    if (EG(exception)) {
+        /* thrown by a callback or a typed property, which says enough */
+    } else if (intern->decoder.error) {
+        php_error_docref(NULL, E_WARNING, "%s", intern->decoder.error);
+    } else if (intern->format != JSON_PATH_FORMAT_JSON) {
+        php_error_docref(NULL, E_WARNING, "%s", intern->binary.error ?
+            intern->binary.error : "Failed parsing input");
+    } else if (!intern->transform || !intern->transform->failed) {
+        php_error_docref(NULL, E_WARNING, "Failed parsing JSON");
+    }
+
+    json_path_parse_cleanup(intern);
+
+    return 0;
+}
+
+static int json_path_parse_chunk(json_path_object *intern,
+    const unsigned char *buf, size_t len)
+{
+    if (!json_path_decoder_feed(&intern->decoder, buf, len)) {
+        return json_path_parse_failed(intern);
+    }
+
+    return 1;
+}
+
+static int json_path_parse_resume(json_path_object *intern)
+{
+    if (!json_path_decoder_resume(&intern->decoder)) {
+        return json_path_parse_failed(intern);
+    }
+
+    return 1;
+}
+
+static int json_path_parse_end(json_path_object *intern)
+{
+    if (!json_path_decoder_finish(&intern->decoder)) {
+        return json_path_parse_failed(intern);
+    }
+
+    if (intern->transform) {
+        /* a trailing number is only completed here, past the last chunk */
+        intern->transform->chunk_off = intern->transform->input_off;
+    }
+
+    if (intern->format != JSON_PATH_FORMAT_JSON) {
+        if (!json_path_binary_finish(intern)) {
+            return json_path_parse_failed(intern);
+        }
+        json_path_parse_release(intern);
+        return 1;
+    }
+
+    /* values == 0: an empty document, which the handle no longer rejects
+     * itself once it has seen a value */
+    if (yajl_complete_parse(intern->yh) != yajl_status_ok ||
+        intern->values == 0 ||
+        (intern->transform && intern->transform->failed)) {
+        return json_path_parse_failed(intern);
+    }
+
+    json_path_parse_release(intern);
+
+    return 1;
+}
+
+static int json_path_parse_string(json_path_object *intern, char *json,
+    size_t json_len)
+{
+    json_path_parse_begin(intern);
+
+    return json_path_parse_chunk(intern, (const unsigned char *) json,
+        json_len) && json_path_parse_end(intern);
+}
+
+#ifdef HAVE_JSON_PATH_THREADS
+/* Starts a thread with every signal blocked, so that signals such as the
+ * execution timeout stay on the PHP thread */
+static int json_path_thread_start(pthread_t *thread, void *(*main)(void *),
+    void *arg)
+{
+    sigset_t all, old;
+    int err;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    err = pthread_create(thread, NULL, main, arg);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    return err == 0;
+}
+
+/* Read-ahead: a background thread reads (and decompresses) the input into
+ * a ring of large buffers while the PHP thread tokenizes the oldest one.
+ * The slot at head stays owned by the parser until it is released, so the
+ * reader can run up to JSON_PATH_READ_AHEAD_BUFFERS-1 buffers ahead. */
+static void json_path_read_ahead_publish(json_path_read_ahead *ra)
+{
+    pthread_mutex_lock(&ra->lock);
+    ra->lens[(ra->head + ra->count) % JSON_PATH_READ_AHEAD_BUFFERS] =
+        ra->fill_len;
+    ra->count++;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+
+    ra->fill = NULL;
+}
+
+static int json_path_read_ahead_sink(void *ctx, const unsigned char *buf,
+    size_t len)
+{
+    json_path_read_ahead *ra = (json_path_read_ahead *) ctx;
+
+    while (len > 0) {
+        size_t n;
+
+        if (!ra->fill) {
+            pthread_mutex_lock(&ra->lock);
+            while (ra->count == JSON_PATH_READ_AHEAD_BUFFERS && !ra->cancel) {
+                pthread_cond_wait(&ra->cond, &ra->lock);
+            }
+            if (ra->cancel) {
+                pthread_mutex_unlock(&ra->lock);
+                return 0;
+            }
+            ra->fill = ra->bufs[(ra->head + ra->count) %
+                JSON_PATH_READ_AHEAD_BUFFERS];
+            ra->fill_len = 0;
+            pthread_mutex_unlock(&ra->lock);
+        }
+
+        n = MIN(JSON_PATH_READ_AHEAD_BUFFER_SIZE - ra->fill_len, len);
+        memcpy(ra->fill + ra->fill_len, buf, n);
+        ra->fill_len += n;
+        buf += n;
+        len -= n;
+
+        if (ra->fill_len == JSON_PATH_READ_AHEAD_BUFFER_SIZE) {
+            json_path_read_ahead_publish(ra);
+        }
+    }
+
+    return 1;
+}
+
+/* Waits until fd is readable, giving up when the parser has cancelled.
+ * Plain files are always readable; this only ever waits on pipes. */
+static int json_path_read_ahead_wait(json_path_read_ahead *ra)
+{
+    struct pollfd pfd;
+    int cancel;
+
+    pfd.fd = ra->fd;
+    pfd.events = POLLIN;
+
+    for (;;) {
+        pthread_mutex_lock(&ra->lock);
+        cancel = ra->cancel;
+        pthread_mutex_unlock(&ra->lock);
+
+        if (cancel) {
+            return 0;
+        }
+
+        if (poll(&pfd, 1, 100) != 0) {
+            return 1;
+        }
+    }
+}
+
+static void *json_path_read_ahead_main(void *arg)
+{
+    json_path_read_ahead *ra = (json_path_read_ahead *) arg;
+    unsigned char *raw = pemalloc(JSON_PATH_READ_BUFFER_SIZE, 1);
+    const char *error = NULL;
+    ssize_t n;
+
+    if (ra->prefix_len && !json_path_decoder_feed(&ra->decoder, ra->prefix,
+        ra->prefix_len)) {
+        error = ra->decoder.error;
+        goto done;
+    }
+
+    for (;;) {
+        if (!json_path_read_ahead_wait(ra)) {
+            break;
+        }
+
+        n = read(ra->fd, raw, JSON_PATH_READ_BUFFER_SIZE);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n < 0) {
+            error = "Failed reading input";
+            break;
+        }
+
+        if (n == 0) {
+            if (!json_path_decoder_finish(&ra->decoder)) {
+                error = ra->decoder.error;
+            } else {
+                ra->eof = 1;
+            }
+            break;
+        }
+
+        if (!json_path_decoder_feed(&ra->decoder, raw, n)) {
+            error = ra->decoder.error;
+            break;
+        }
+
+        /* Hand over partial buffers too, so a slow pipe never holds back
+         * data the parser could already be working on. */
+        if (ra->fill && ra->fill_len) {
+            json_path_read_ahead_publish(ra);
+        }
+    }
+
+done:
+    if (ra->fill && ra->fill_len && !error) {
+        json_path_read_ahead_publish(ra);
+    }
+
+    pefree(raw, 1);
+
+    pthread_mutex_lock(&ra->lock);
+    ra->error = error;
+    ra->done = 1;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+
+    return NULL;
+}
+
+/* Only plain files and pipes without read filters are read behind PHP's
+ * back. Whatever PHP has already buffered is handed to the reader first. */
+/* Returns 0 when the stream is not read ahead and -1 when reading what
+ * it had buffered failed */
+static int json_path_read_ahead_start(json_path_read_ahead *ra,
+    php_stream *stream)
+{
+    size_t buffered;
+    ssize_t amt_read;
+    int i;
+
+    if (!php_stream_is(stream, PHP_STREAM_IS_STDIO) ||
+        stream->readfilters.head ||
+        !php_stream_can_cast(stream, PHP_STREAM_AS_FD)) {
+        return 0;
+    }
+
+    memset(ra, 0, sizeof(*ra));
+
+    buffered = stream->writepos - stream->readpos;
+    if (buffered > 0) {
+        ra->prefix = emalloc(buffered);
+        amt_read = php_stream_read(stream, (char *) ra->prefix, buffered);
+        if (amt_read < 0) {
+            efree(ra->prefix);
+            return -1;
+        }
+        ra->prefix_len = amt_read;
+    }
+
+    if (php_stream_cast(stream, PHP_STREAM_AS_FD, (void **) &ra->fd,
+        REPORT_ERRORS) != SUCCESS) {
+        if (ra->prefix) {
+            efree(ra->prefix);
+        }
+        return 0;
+    }
+
+    for (i=0; i < JSON_PATH_READ_AHEAD_BUFFERS; i++) {
+        ra->bufs[i] = emalloc(JSON_PATH_READ_AHEAD_BUFFER_SIZE);
+    }
+
+    json_path_decoder_init(&ra->decoder, json_path_read_ahead_sink, ra);
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->cond, NULL);
+
+    if (!json_path_thread_start(&ra->thread, json_path_read_ahead_main, ra)) {
+        ra->done = 1;
+        ra->error = "Failed starting read-ahead thread";
+        return 1;
+    }
+
+    ra->started = 1;
+
+    return 1;
+}
+
+static void json_path_read_ahead_stop(json_path_read_ahead *ra)
+{
+    int i;
+
+    if (ra->started) {
+        pthread_mutex_lock(&ra->lock);
+        ra->cancel = 1;
+        pthread_cond_broadcast(&ra->cond);
+        pthread_mutex_unlock(&ra->lock);
+        pthread_join(ra->thread, NULL);
+    }
+
+    json_path_decoder_free(&ra->decoder);
+    pthread_cond_destroy(&ra->cond);
+    pthread_mutex_destroy(&ra->lock);
+
+    for (i=0; i < JSON_PATH_READ_AHEAD_BUFFERS; i++) {
+        efree(ra->bufs[i]);
+    }
+
+    if (ra->prefix) {
+        efree(ra->prefix);
+    }
+}
+
+static int json_path_parse_read_ahead(json_path_object *intern,
+    json_path_read_ahead *ra, php_stream *stream)
+{
+    int ok = 1;
+
+    for (;;) {
+        int slot;
+
+        pthread_mutex_lock(&ra->lock);
+        while (ra->count == 0 && !ra->done) {
+            pthread_cond_wait(&ra->cond, &ra->lock);
+        }
+        if (ra->count == 0) {
+            pthread_mutex_unlock(&ra->lock);
+            break;
+        }
+        slot = ra->head;
+        pthread_mutex_unlock(&ra->lock);
+
+        ok = json_path_feed_tokenizer(intern, ra->bufs[slot], ra->lens[slot]);
+
+        pthread_mutex_lock(&ra->lock);
+        ra->head = (ra->head + 1) % JSON_PATH_READ_AHEAD_BUFFERS;
+        ra->count--;
+        pthread_cond_broadcast(&ra->cond);
+        pthread_mutex_unlock(&ra->lock);
+
+        if (!ok) {
+            break;
+        }
+    }
+
+    json_path_read_ahead_stop(ra);
+
+    if (ok && ra->error) {
+        intern->decoder.error = ra->error;
+        ok = 0;
+    }
+
+    if (ra->eof) {
+        stream->eof = 1;
+    }
+
+    if (!ok) {
+        return json_path_parse_failed(intern);
+    }
+
+    return json_path_parse_end(intern);
+}
+#endif
+
+static int json_path_parse_stream(json_path_object *intern, php_stream *stream)
+{
+    unsigned char *buf;
+    ssize_t amt_read;
+
+    json_path_parse_begin(intern);
+
+#ifdef HAVE_JSON_PATH_THREADS
+    if (intern->read_ahead) {
+        json_path_read_ahead ra;
+
+        switch (json_path_read_ahead_start(&ra, stream)) {
+            case -1:
+                php_error_docref(NULL, E_WARNING, "Failed reading input");
+                json_path_parse_cleanup(intern);
+                return 0;
+            case 1:
+                return json_path_parse_read_ahead(intern, &ra, stream);
+        }
+    }
+#endif
+
+    buf = emalloc(JSON_PATH_READ_BUFFER_SIZE);
+
+    while (!php_stream_eof(stream)) {
+        amt_read = php_stream_read(stream, (char *) buf,
+            JSON_PATH_READ_BUFFER_SIZE);
+
+        if (amt_read < 0) {
+            break;
+        }
+
+        if (!json_path_parse_chunk(intern, buf, amt_read)) {
+            efree(buf);
+            return 0;
+        }
+    }
+
+    efree(buf);
+
+    return json_path_parse_end(intern);
+}
+
+/* Sidecar index: byte ranges of object members and array elements down to
+ * a fixed depth. A parse with an index only tokenizes the subtrees the
+ * registered paths can reach, with path_stack rebuilt to the subtree's
+ * position first. All integers are stored little-endian. */
+#define JSON_PATH_INDEX_MAGIC "JPIX"
+#define JSON_PATH_INDEX_VERSION 3
+#define JSON_PATH_INDEX_HEADER_SIZE 56
+#define JSON_PATH_INDEX_ENTRY_SIZE 32
+#define JSON_PATH_INDEX_MAX_DEPTH 64
+#define JSON_PATH_INDEX_NONE 0xffffffffU
+#define JSON_PATH_INDEX_NO_KEY 0xffffffffU
+#define JSON_PATH_INDEX_SAMPLE_SIZE 4096
+
+typedef struct json_path_index_entry {
+    uint32_t parent;
+    uint32_t key_len;
+    uint64_t key;
+    uint64_t start;
+    uint64_t end;
+} json_path_index_entry;
+
+typedef struct json_path_index_frame {
+    char type;
+    int expect_key;
+    uint32_t entry;
+    uint64_t index;
+} json_path_index_frame;
+
+typedef struct json_path_index_builder {
+    zend_long max_depth;
+    simple_vector entries;
+    simple_vector frames;
+    smart_str keys;
+    HashTable key_offsets;
+    smart_str key;
+    smart_str decoded;
+    uint64_t key_off;
+    uint32_t key_len;
+    int in_string;
+    int escape;
+    int capturing_key;
+    int in_scalar;
+    uint32_t open_value;
+    uint64_t offset;
+    int error;
+    uint64_t mtime;
+    unsigned char head[JSON_PATH_INDEX_SAMPLE_SIZE];
+    size_t head_len;
+    unsigned char tail[JSON_PATH_INDEX_SAMPLE_SIZE];
+    size_t tail_len;
+} json_path_index_builder;
+
+typedef struct json_path_index {
+    zend_string *data;
+    uint32_t depth;
+    uint64_t source_size;
+    uint64_t mtime;
+    uint64_t fingerprint;
+    uint64_t count;
+    const unsigned char *entries;
+    const char *keys;
+    uint64_t keys_len;
+} json_path_index;
+
+typedef struct json_path_index_range {
+    uint64_t start;
+    uint64_t end;
+    uint32_t entry;
+} json_path_index_range;
+
+static inline void json_path_put_u32(unsigned char *p, uint32_t v)
+{
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static inline void json_path_put_u64(unsigned char *p, uint64_t v)
+{
+    json_path_put_u32(p, (uint32_t) v);
+    json_path_put_u32(p + 4, (uint32_t) (v >> 32));
+}
+
+static inline uint32_t json_path_get_u32(const unsigned char *p)
+{
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) |
+        ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static inline uint64_t json_path_get_u64(const unsigned char *p)
+{
+    return (uint64_t) json_path_get_u32(p) |
+        ((uint64_t) json_path_get_u32(p + 4) << 32);
+}
+
+static void json_path_index_builder_init(json_path_index_builder *b,
+    zend_long max_depth)
+{
+    memset(b, 0, sizeof(*b));
+    b->max_depth = max_depth;
+    b->open_value = JSON_PATH_INDEX_NONE;
+    simple_vector_init(&b->entries, sizeof(json_path_index_entry));
+    simple_vector_init(&b->frames, sizeof(json_path_index_frame));
+    zend_hash_init(&b->key_offsets, 64, NULL, NULL, 0);
+}
+
+static void json_path_index_builder_free(json_path_index_builder *b)
+{
+    simple_vector_free(&b->entries);
+    simple_vector_free(&b->frames);
+    smart_str_free(&b->keys);
+    smart_str_free(&b->key);
+    smart_str_free(&b->decoded);
+    zend_hash_destroy(&b->key_offsets);
+}
+
+/* Staleness check beyond the size: a hash of the source's first and last
+ * blocks, which catches same-size edits near either end. */
+static uint64_t json_path_index_fingerprint(const unsigned char *head,
+    size_t head_len, const unsigned char *tail, size_t tail_len)
+{
+    return json_path_hash('h', head, head_len) ^
+        (json_path_hash('t', tail, tail_len) * 0x9e3779b97f4a7c15ULL);
+}
+
+/* Keeps the first and last JSON_PATH_INDEX_SAMPLE_SIZE bytes seen */
+static void json_path_index_sample(json_path_index_builder *b,
+    const unsigned char *buf, size_t len)
+{
+    size_t n, keep;
+
+    if (b->head_len < JSON_PATH_INDEX_SAMPLE_SIZE) {
+        n = MIN(len, JSON_PATH_INDEX_SAMPLE_SIZE - b->head_len);
+        memcpy(b->head + b->head_len, buf, n);
+        b->head_len += n;
+    }
+
+    if (len >= JSON_PATH_INDEX_SAMPLE_SIZE) {
+        memcpy(b->tail, buf + len - JSON_PATH_INDEX_SAMPLE_SIZE,
+            JSON_PATH_INDEX_SAMPLE_SIZE);
+        b->tail_len = JSON_PATH_INDEX_SAMPLE_SIZE;
+        return;
+    }
+
+    keep = MIN(b->tail_len, JSON_PATH_INDEX_SAMPLE_SIZE - len);
+    memmove(b->tail, b->tail + b->tail_len - keep, keep);
+    memcpy(b->tail + keep, buf, len);
+    b->tail_len = keep + len;
+}
+
+static int json_path_index_hex4(const char *p, const char *end,
+    unsigned int *cp)
+{
+    int i;
+
+    if (end - p < 4) {
+        return 0;
+    }
+
+    *cp = 0;
+    for (i=0; i < 4; i++) {
+        char c = p[i];
+
+        *cp <<= 4;
+        if (c >= '0' && c <= '9') {
+            *cp |= c - '0';
+        } else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+            *cp |= (c | 0x20) - 'a' + 10;
+        } else {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void json_path_index_append_utf8(smart_str *out, unsigned int cp)
+{
+    if (cp < 0x80) {
+        smart_str_appendc(out, (char) cp);
+    } else if (cp < 0x800) {
+        smart_str_appendc(out, (char) (0xc0 | (cp >> 6)));
+        smart_str_appendc(out, (char) (0x80 | (cp & 0x3f)));
+    } else if (cp < 0x10000) {
+        smart_str_appendc(out, (char) (0xe0 | (cp >> 12)));
+        smart_str_appendc(out, (char) (0x80 | ((cp >> 6) & 0x3f)));
+        smart_str_appendc(out, (char) (0x80 | (cp & 0x3f)));
+    } else {
+        smart_str_appendc(out, (char) (0xf0 | (cp >> 18)));
+        smart_str_appendc(out, (char) (0x80 | ((cp >> 12) & 0x3f)));
+        smart_str_appendc(out, (char) (0x80 | ((cp >> 6) & 0x3f)));
+        smart_str_appendc(out, (char) (0x80 | (cp & 0x3f)));
+    }
+}
+
+/* Decodes the escapes in a key as captured from the source, so stored
+ * keys compare equal to the ones the tokenizer reports. A high surrogate
+ * without its pair becomes '?', as the tokenizer decodes it. */
+static void json_path_index_unescape(smart_str *out, const char *p,
+    size_t len)
+{
+    const char *end = p + len;
+
+    if (out->s) {
+        ZSTR_LEN(out->s) = 0;
+    }
+
+    while (p < end) {
+        const char *s = p;
+        unsigned int cp, lo;
+
+        while (p < end && *p != '\\') { p++; }
+        smart_str_appendl(out, s, p - s);
+
+        if (end - p < 2) {
+            smart_str_appendl(out, p, end - p);
+            break;
+        }
+
+        switch (p[1]) {
+            case 'b': smart_str_appendc(out, '\b'); break;
+            case 'f': smart_str_appendc(out, '\f'); break;
+            case 'n': smart_str_appendc(out, '\n'); break;
+            case 'r': smart_str_appendc(out, '\r'); break;
+            case 't': smart_str_appendc(out, '\t'); break;
+            case 'u':
+                if (!json_path_index_hex4(p + 2, end, &cp)) {
+                    smart_str_appendl(out, p, 2);
+                    break;
+                }
+                p += 4;
+                if ((cp & 0xfc00) == 0xd800) {
+                    if (end - p >= 8 && p[2] == '\\' && p[3] == 'u' &&
+                        json_path_index_hex4(p + 4, end, &lo) &&
+                        (lo & 0xfc00) == 0xdc00) {
+                        cp = 0x10000 + ((cp & 0x3ff) << 10) + (lo & 0x3ff);
+                        p += 6;
+                    } else {
+                        cp = '?';
+                    }
+                }
+                json_path_index_append_utf8(out, cp);
+                break;
+            default:
+                smart_str_appendc(out, p[1]);
+                break;
+        }
+        p += 2;
+    }
+
+    smart_str_0(out);
+}
+
+/* Keys are stored decoded, once in the key table however often they
+ * repeat. */
+static void json_path_index_key_done(json_path_index_builder *b)
+{
+    const char *key = "";
+    size_t key_len = 0;
+    zval *off, zv;
+
+    if (b->key.s && ZSTR_LEN(b->key.s) > 0) {
+        json_path_index_unescape(&b->decoded, ZSTR_VAL(b->key.s),
+            ZSTR_LEN(b->key.s));
+        if (b->decoded.s) {
+            key = ZSTR_VAL(b->decoded.s);
+            key_len = ZSTR_LEN(b->decoded.s);
+        }
+    }
+
+    if ((off = zend_hash_str_find(&b->key_offsets, key, key_len)) != NULL) {
+        b->key_off = Z_LVAL_P(off);
+    } else {
+        b->key_off = b->keys.s ? ZSTR_LEN(b->keys.s) : 0;
+        smart_str_appendl(&b->keys, key, key_len);
+        ZVAL_LONG(&zv, (zend_long) b->key_off);
+        zend_hash_str_add(&b->key_offsets, key, key_len, &zv);
+    }
+
+    b->key_len = (uint32_t) key_len;
+}
+
+/* Records a value starting at pos if it lies within the indexed depth.
+ * Returns its entry id, or JSON_PATH_INDEX_NONE. */
+static uint32_t json_path_index_value_start(json_path_index_builder *b,
+    uint64_t pos)
+{
+    json_path_index_frame *top;
+    json_path_index_entry e;
+
+    if (b->frames.len == 0) {
+        return JSON_PATH_INDEX_NONE;
+    }
+
+    top = simple_vector_get_last(&b->frames, json_path_index_frame);
+
+    if (top->type == '[') {
+        e.key = top->index++;
+        e.key_len = JSON_PATH_INDEX_NO_KEY;
+    } else {
+        e.key = b->key_off;
+        e.key_len = b->key_len;
+    }
+
+    if (b->frames.len > b->max_depth ||
+        b->entries.len == (int) (JSON_PATH_INDEX_NONE - 1)) {
+        return JSON_PATH_INDEX_NONE;
+    }
+
+    e.parent = top->entry;
+    e.start = pos;
+    e.end = pos;
+
+    simple_vector_append(&b->entries, &e);
+
+    return b->entries.len - 1;
+}
+
+static inline void json_path_index_value_end(json_path_index_builder *b,
+    uint32_t entry, uint64_t pos)
+{
+    if (entry != JSON_PATH_INDEX_NONE) {
+        simple_vector_get(&b->entries, json_path_index_entry, entry)->end = pos;
+    }
+}
+
+/* A quote- and bracket-aware structural scan. It trusts the document to be
+ * well-formed JSON beyond balanced brackets; the tokenizer validates the
+ * subtrees that are actually parsed later. */
+static void json_path_index_scan(json_path_index_builder *b,
+    const unsigned char *buf, size_t len)
+{
+    const unsigned char *p = buf, *end = buf + len;
+
+    while (p < end && !b->error) {
+        json_path_index_frame *top;
+        json_path_index_frame frame;
+        uint64_t pos = b->offset + (p - buf);
+
+        if (b->in_string) {
+            const unsigned char *s = p;
+
+            if (b->escape) {
+                b->escape = 0;
+                p++;
+            } else {
+                while (p < end && *p != '"' && *p != '\\') { p++; }
+                if (p < end && *p == '\\') {
+                    b->escape = 1;
+                    p++;
+                }
+            }
+
+            if (b->capturing_key) {
+                smart_str_appendl(&b->key, (const char *) s, p - s);
+            }
+
+            if (p < end && *p == '"' && !b->escape) {
+                b->in_string = 0;
+                if (b->capturing_key) {
+                    b->capturing_key = 0;
+                    if (b->frames.len <= b->max_depth) {
+                        json_path_index_key_done(b);
+                    }
+                } else {
+                    json_path_index_value_end(b, b->open_value,
+                        b->offset + (p - buf) + 1);
+                    b->open_value = JSON_PATH_INDEX_NONE;
+                }
+                p++;
+            }
+            continue;
+        }
+
+        if (b->in_scalar) {
+            if (*p != ' ' && *p != '\t' && *p != '\n' && *p != '\r' &&
+                *p != ',' && *p != '}' && *p != ']') {
+                p++;
+                continue;
+            }
+            json_path_index_value_end(b, b->open_value, pos);
+            b->open_value = JSON_PATH_INDEX_NONE;
+            b->in_scalar = 0;
+        }
+
+        top = b->frames.len ? simple_vector_get_last(&b->frames,
+            json_path_index_frame) : NULL;
+
+        switch (*p) {
+            case ' ':
+            case '\t':
+            case '\n':
+            case '\r':
+            case ':':
+                break;
+            case ',':
+                if (top && top->type == '{') {
+                    top->expect_key = 1;
+                }
+                break;
+            case '"':
+                if (top && top->type == '{' && top->expect_key) {
+                    top->expect_key = 0;
+                    b->capturing_key = b->frames.len <= b->max_depth;
+                    if (b->key.s) {
+                        ZSTR_LEN(b->key.s) = 0;
+                    }
+                } else {
+                    b->open_value = json_path_index_value_start(b, pos);
+                }
+                b->in_string = 1;
+                break;
+            case '{':
+            case '[':
+                frame.entry = json_path_index_value_start(b, pos);
+                frame.type = *p;
+                frame.expect_key = (*p == '{');
+                frame.index = 0;
+                simple_vector_append(&b->frames, &frame);
+                break;
+            case '}':
+            case ']':
+                if (!top || top->type != (*p == '}' ? '{' : '[')) {
+                    b->error = 1;
+                    break;
+                }
+                json_path_index_value_end(b, top->entry, pos + 1);
+                simple_vector_pop(&b->frames);
+                break;
+            default:
+                b->open_value = json_path_index_value_start(b, pos);
+                b->in_scalar = 1;
+                break;
+        }
+        p++;
+    }
+
+    b->offset += len;
+}
+
+static int json_path_index_finish(json_path_index_builder *b)
+{
+    if (b->in_scalar) {
+        json_path_index_value_end(b, b->open_value, b->offset);
+        b->in_scalar = 0;
+    }
+
+    return !b->error && !b->in_string && b->frames.len == 0;
+}
+
+static int json_path_index_write(json_path_index_builder *b, php_stream *out)
+{
+    unsigned char header[JSON_PATH_INDEX_HEADER_SIZE];
+    unsigned char *buf, *p;
+    size_t keys_len = b->keys.s ? ZSTR_LEN(b->keys.s) : 0;
+    int i, ok = 1;
+
+    memcpy(header, JSON_PATH_INDEX_MAGIC, 4);
+    json_path_put_u32(header + 4, JSON_PATH_INDEX_VERSION);
+    json_path_put_u32(header + 8, (uint32_t) b->max_depth);
+    json_path_put_u32(header + 12, 0);
+    json_path_put_u64(header + 16, b->offset);
+    json_path_put_u64(header + 24, b->entries.len);
+    json_path_put_u64(header + 32, keys_len);
+    json_path_put_u64(header + 40, b->mtime);
+    json_path_put_u64(header + 48, json_path_index_fingerprint(b->head,
+        b->head_len, b->tail, b->tail_len));
+
+    if (php_stream_write(out, (char *) header, sizeof(header)) !=
+        sizeof(header)) {
+        return 0;
+    }
+
+    buf = emalloc(JSON_PATH_READ_BUFFER_SIZE);
+    p = buf;
+
+    for (i=0; i < b->entries.len && ok; i++) {
+        json_path_index_entry *e = simple_vector_get(&b->entries,
+            json_path_index_entry, i);
+
+        json_path_put_u32(p, e->parent);
+        json_path_put_u32(p + 4, e->key_len);
+        json_path_put_u64(p + 8, e->key);
+        json_path_put_u64(p + 16, e->start);
+        json_path_put_u64(p + 24, e->end);
+        p += JSON_PATH_INDEX_ENTRY_SIZE;
+
+        if (p - buf == JSON_PATH_READ_BUFFER_SIZE || i == b->entries.len - 1) {
+            ok = php_stream_write(out, (char *) buf, p - buf) == p - buf;
+            p = buf;
+        }
+    }
+
+    efree(buf);
+
+    if (ok && keys_len) {
+        ok = php_stream_write(out, ZSTR_VAL(b->keys.s), keys_len) ==
+            (ssize_t) keys_len;
+    }
+
+    return ok;
+}
+
+static inline void json_path_index_entry_at(json_path_index *idx, uint32_t i,
+    json_path_index_entry *e)
+{
+    const unsigned char *p = idx->entries + (uint64_t) i *
+        JSON_PATH_INDEX_ENTRY_SIZE;
+
+    e->parent = json_path_get_u32(p);
+    e->key_len = json_path_get_u32(p + 4);
+    e->key = json_path_get_u64(p + 8);
+    e->start = json_path_get_u64(p + 16);
+    e->end = json_path_get_u64(p + 24);
+}
+
+/* Everything later reads relies on these: ranges inside the source and
+ * their parent's range, parents before children, keys inside the key
+ * table. A file failing any of them is rejected as a whole. */
+static int json_path_index_valid(json_path_index *idx)
+{
+    json_path_index_entry e, parent;
+    uint32_t i;
+
+    for (i=0; i < idx->count; i++) {
+        json_path_index_entry_at(idx, i, &e);
+
+        if (e.start > e.end || e.end > idx->source_size) {
+            return 0;
+        }
+        if (e.key_len != JSON_PATH_INDEX_NO_KEY && (e.key > idx->keys_len ||
+            e.key_len > idx->keys_len - e.key)) {
+            return 0;
+        }
+        if (e.parent == JSON_PATH_INDEX_NONE) {
+            continue;
+        }
+        if (e.parent >= i) {
+            return 0;
+        }
+
+        json_path_index_entry_at(idx, e.parent, &parent);
+        if (e.start < parent.start || e.end > parent.end) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int json_path_index_load(json_path_index *idx, zend_string *index_file)
+{
+    php_stream *stream;
+    const unsigned char *p;
+
+    memset(idx, 0, sizeof(*idx));
+
+    stream = php_stream_open_wrapper(ZSTR_VAL(index_file), "rb",
+        REPORT_ERRORS, NULL);
+    if (!stream) {
+        return 0;
+    }
+
+    idx->data = php_stream_copy_to_mem(stream, PHP_STREAM_COPY_ALL, 0);
+    php_stream_close(stream);
+
+    if (!idx->data || ZSTR_LEN(idx->data) < JSON_PATH_INDEX_HEADER_SIZE ||
+        memcmp(ZSTR_VAL(idx->data), JSON_PATH_INDEX_MAGIC, 4) != 0) {
+        goto invalid;
+    }
+
+    p = (const unsigned char *) ZSTR_VAL(idx->data);
+
+    if (json_path_get_u32(p + 4) != JSON_PATH_INDEX_VERSION) {
+        goto invalid;
+    }
+
+    idx->depth = json_path_get_u32(p + 8);
+    idx->source_size = json_path_get_u64(p + 16);
+    idx->count = json_path_get_u64(p + 24);
+    idx->keys_len = json_path_get_u64(p + 32);
+    idx->mtime = json_path_get_u64(p + 40);
+    idx->fingerprint = json_path_get_u64(p + 48);
+
+    if (idx->count >= JSON_PATH_INDEX_NONE ||
+        (ZSTR_LEN(idx->data) - JSON_PATH_INDEX_HEADER_SIZE) /
+        JSON_PATH_INDEX_ENTRY_SIZE < idx->count ||
+        ZSTR_LEN(idx->data) != JSON_PATH_INDEX_HEADER_SIZE +
+        idx->count * JSON_PATH_INDEX_ENTRY_SIZE + idx->keys_len) {
+        goto invalid;
+    }
+
+    idx->entries = p + JSON_PATH_INDEX_HEADER_SIZE;
+    idx->keys = (const char *) idx->entries +
+        idx->count * JSON_PATH_INDEX_ENTRY_SIZE;
+
+    if (!json_path_index_valid(idx)) {
+        goto invalid;
+    }
+
+    return 1;
+
+invalid:
+    php_error_docref(NULL, E_WARNING, "Invalid index file %s",
+        ZSTR_VAL(index_file));
+    if (idx->data) {
+        zend_string_release(idx->data);
+        idx->data = NULL;
+    }
+    return 0;
+}
+
+/* Appends every child of parent matching c; an object may repeat a key.
+ * Entries are in document order, so a container's children all lie
+ * between it and the first entry starting past its end. */
+static void json_path_index_find_children(json_path_index *idx,
+    uint32_t parent, json_path_component *c, simple_vector *found)
+{
+    json_path_index_entry e;
+    uint64_t limit = UINT64_MAX;
+    uint32_t i = 0;
+
+    if (parent != JSON_PATH_INDEX_NONE) {
+        json_path_index_entry_at(idx, parent, &e);
+        limit = e.end;
+        i = parent + 1;
+    }
+
+    for (; i < idx->count; i++) {
+        json_path_index_entry_at(idx, i, &e);
+
+        if (e.start >= limit) {
+            break;
+        }
+        if (e.parent != parent) {
+            continue;
+        }
+
+        if (c->type == COMPONENT_ARRAY_KEY) {
+            if (e.key_len == JSON_PATH_INDEX_NO_KEY &&
+                e.key == (uint64_t) c->index) {
+                simple_vector_append(found, &i);
+                return;
+            }
+        } else if (e.key_len == ZSTR_LEN(c->key) &&
+            e.key + e.key_len <= idx->keys_len &&
+            memcmp(idx->keys + e.key, ZSTR_VAL(c->key), e.key_len) == 0) {
+            simple_vector_append(found, &i);
+        }
+    }
+}
+
+static int json_path_index_range_compare(const void *a, const void *b)
+{
+    const json_path_index_range *ra = a, *rb = b;
+
+    if (ra->start != rb->start) {
+        return ra->start < rb->start ? -1 : 1;
+    }
+    return ra->end > rb->end ? -1 : (ra->end < rb->end);
+}
+
+/* Picks the deepest indexed subtrees each path can match in, one per
+ * repeat of a key along the way. Returns 0 when some path needs the whole
+ * document (a leading wildcard, say). */
+static int json_path_index_ranges(json_path_object *intern,
+    json_path_index *idx, simple_vector *ranges)
+{
+    json_path_index_range *sorted;
+    simple_vector cur, next, tmp;
+    uint32_t root = JSON_PATH_INDEX_NONE;
+    int i, n = 0, whole = 0;
+
+    simple_vector_init(&cur, sizeof(uint32_t));
+    simple_vector_init(&next, sizeof(uint32_t));
+
+    for (i=0; i < intern->paths.len; i++) {
+        json_path *path = simple_vector_get(&intern->paths, json_path, i);
+        int j, k;
+
+        cur.len = 0;
+        simple_vector_append(&cur, &root);
+
+        for (j=0; j < path->components.len && j < (int) idx->depth; j++) {
+            json_path_component *c = simple_vector_get(&path->components,
+                json_path_component, j);
+
+            if (c->wildcard) {
+                break;
+            }
+
+            next.len = 0;
+            for (k=0; k < cur.len; k++) {
+                json_path_index_find_children(idx,
+                    *simple_vector_get(&cur, uint32_t, k), c, &next);
+            }
+
+            /* no match below; parsing the parents is still correct */
+            if (next.len == 0) {
+                break;
+            }
+
+            tmp = cur;
+            cur = next;
+            next = tmp;
+        }
+
+        if (*simple_vector_get(&cur, uint32_t, 0) == JSON_PATH_INDEX_NONE) {
+            whole = 1;
+            break;
+        }
+
+        for (k=0; k < cur.len; k++) {
+            json_path_index_range range;
+            json_path_index_entry e;
+
+            range.entry = *simple_vector_get(&cur, uint32_t, k);
+            json_path_index_entry_at(idx, range.entry, &e);
+            range.start = e.start;
+            range.end = e.end;
+            simple_vector_append(ranges, &range);
+        }
+    }
+
+    simple_vector_free(&cur);
+    simple_vector_free(&next);
+
+    if (whole) {
+        return 0;
+    }
+
+    /* Drop ranges nested in (or equal to) an earlier one */
+    sorted = (json_path_index_range *) ranges->elems;
+    qsort(sorted, ranges->len, sizeof(json_path_index_range),
+        json_path_index_range_compare);
+
+    for (i=0; i < ranges->len; i++) {
+        if (n > 0 && sorted[i].start < sorted[n-1].end) {
+            continue;
+        }
+        sorted[n++] = sorted[i];
+    }
+    ranges->len = n;
+
+    return 1;
+}
+
+/* Rebuilds path_stack as it would be just before the entry's value is
+ * tokenized: array parents sit one index short of it (the value's first
+ * event advances them), map parents already hold the key. */
+static void json_path_index_push_prefix(json_path_object *intern,
+    json_path_index *idx, uint32_t entry)
+{
+    uint32_t chain[JSON_PATH_INDEX_MAX_DEPTH];
+    int n = 0, i;
+
+    while (entry != JSON_PATH_INDEX_NONE && n < JSON_PATH_INDEX_MAX_DEPTH) {
+        json_path_index_entry e;
+
+        chain[n++] = entry;
+        json_path_index_entry_at(idx, entry, &e);
+        entry = e.parent;
+    }
+
+    for (i=n-1; i >= 0; i--) {
+        json_path_index_entry e;
+        json_path_stack_elem stack_elem;
+
+        json_path_index_entry_at(idx, chain[i], &e);
+
+        if (e.key_len == JSON_PATH_INDEX_NO_KEY) {
+            stack_elem.type = TYPE_ARRAY;
+            stack_elem.index = (zend_long) e.key - (i == 0);
+        } else {
+            stack_elem.type = TYPE_OBJECT;
+            stack_elem.key = zend_string_init(idx->keys + e.key, e.key_len, 0);
+        }
+
+        simple_vector_append(&intern->path_stack, &stack_elem);
+    }
+
+    if (n > 0 && simple_vector_get_last(&intern->path_stack,
+        json_path_stack_elem)->type == TYPE_OBJECT) {
+        json_path_check_for_matches(intern);
+    }
+}
+
+static int json_path_index_feed_range(json_path_object *intern,
+    json_path_index *idx, json_path_index_range *range, const char *json,
+    php_stream *stream)
+{
+    uint64_t remaining = range->end - range->start;
+    int status;
+
+    json_path_index_push_prefix(intern, idx, range->entry);
+    json_path_parse_begin(intern);
+
+    if (!stream) {
+        status = json_path_parse_chunk(intern,
+            (const unsigned char *) json + range->start, remaining) &&
+            json_path_parse_end(intern);
+    } else if (php_stream_seek(stream, range->start, SEEK_SET) != 0) {
+        php_error_docref(NULL, E_WARNING, "Failed seeking in input stream");
+        json_path_parse_cleanup(intern);
+        status = 0;
+    } else {
+        unsigned char *buf = emalloc(JSON_PATH_READ_BUFFER_SIZE);
+
+        status = 1;
+        while (status && remaining > 0) {
+            ssize_t amt_read = php_stream_read(stream, (char *) buf,
+                MIN(remaining, JSON_PATH_READ_BUFFER_SIZE));
+
+            if (amt_read <= 0) {
+                php_error_docref(NULL, E_WARNING,
+                    "Unexpected end of input stream");
+                json_path_parse_cleanup(intern);
+                status = 0;
+                break;
+            }
+
+            status = json_path_parse_chunk(intern, buf, amt_read);
+            remaining -= amt_read;
+        }
+
+        efree(buf);
+
+        if (status) {
+            status = json_path_parse_end(intern);
+        }
+    }
+
+    json_path_stack_clear(&intern->path_stack);
+
+    return status;
+}
+
+static int json_path_index_read_sample(php_stream *stream, uint64_t offset,
+    unsigned char *buf, size_t len)
+{
+    size_t got = 0;
+
+    if (php_stream_seek(stream, offset, SEEK_SET) != 0) {
+        return 0;
+    }
+
+    while (got < len) {
+        ssize_t amt_read = php_stream_read(stream, (char *) buf + got,
+            len - got);
+
+        if (amt_read <= 0) {
+            return 0;
+        }
+        got += amt_read;
+    }
+
+    return 1;
+}
+
+/* Compares size, fingerprint and (for streams that report one) mtime with
+ * what the index was built from. Leaves the stream where it was. */
+static int json_path_index_matches(json_path_index *idx, const char *json,
+    size_t json_len, php_stream *stream)
+{
+    unsigned char head[JSON_PATH_INDEX_SAMPLE_SIZE];
+    unsigned char tail[JSON_PATH_INDEX_SAMPLE_SIZE];
+    php_stream_statbuf ssb;
+    size_t n;
+    zend_off_t pos;
+    int ok;
+
+    if (!stream) {
+        n = MIN(json_len, JSON_PATH_INDEX_SAMPLE_SIZE);
+        return json_len == idx->source_size && idx->fingerprint ==
+            json_path_index_fingerprint((const unsigned char *) json, n,
+                (const unsigned char *) json + json_len - n, n);
+    }
+
+    if (php_stream_stat(stream, &ssb) != 0 ||
+        (uint64_t) ssb.sb.st_size != idx->source_size ||
+        (idx->mtime && (uint64_t) ssb.sb.st_mtime != idx->mtime)) {
+        return 0;
+    }
+
+    n = MIN(idx->source_size, JSON_PATH_INDEX_SAMPLE_SIZE);
+    pos = php_stream_tell(stream);
+    ok = json_path_index_read_sample(stream, 0, head, n) &&
+        json_path_index_read_sample(stream, idx->source_size - n, tail, n) &&
+        idx->fingerprint == json_path_index_fingerprint(head, n, tail, n);
+
+    return php_stream_seek(stream, pos, SEEK_SET) == 0 && ok;
+}
+
+static int json_path_parse_indexed(json_path_object *intern, const char *json,
+    size_t json_len, php_stream *stream, zend_string *index_file)
+{
+    json_path_index idx;
+    simple_vector ranges;
+    int i, status = 1;
+
+    if (!json_path_index_load(&idx, index_file)) {
+        return 0;
+    }
+
+    if (!json_path_index_matches(&idx, json, json_len, stream)) {
+        php_error_docref(NULL, E_WARNING,
+            "Index file %s does not match the input", ZSTR_VAL(index_file));
+        zend_string_release(idx.data);
+        return 0;
+    }
+
+    simple_vector_init(&ranges, sizeof(json_path_index_range));
+
+    if (!json_path_index_ranges(intern, &idx, &ranges)) {
+        status = stream ? json_path_parse_stream(intern, stream) :
+            json_path_parse_string(intern, (char *) json, json_len);
+    } else {
+        for (i=0; i < ranges.len && status; i++) {
+            status = json_path_index_feed_range(intern, &idx,
+                simple_vector_get(&ranges, json_path_index_range, i),
+                json, stream);
+        }
+    }
+
+    simple_vector_free(&ranges);
+    zend_string_release(idx.data);
+
+    return status;
+}
+
+/* Drops whatever a parse that did not finish left behind */
+static void json_path_reset(json_path_object *intern)
+{
+    int i, j;
+
+    for (i=0; i < intern->paths.len; i++) {
+        json_path *path = simple_vector_get(&intern->paths, json_path, i);
+
+        for (j=0; j < path->collection_stack.len; j++) {
+            zval_ptr_dtor(simple_vector_get(&path->collection_stack, zval, j));
+        }
+
+        path->collection_stack.len = 0;
+        path->skip_depth = 0;
+        path->status = STATUS_MATCHING;
+    }
+
+    json_path_stack_clear(&intern->path_stack);
+}
+
+static void json_path_session_end(json_path_object *intern)
+{
+    json_path_session *session = &intern->session;
+
+    zval_ptr_dtor(&session->input);
+    ZVAL_UNDEF(&session->input);
+
+    if (session->buf) {
+        efree(session->buf);
+        session->buf = NULL;
+    }
+
+    session->active = 0;
+
+    json_path_intern_clear(&intern->strings);
+}
+
+static void json_path_session_abort(json_path_object *intern)
+{
+    json_path_parse_cleanup(intern);
+    json_path_session_end(intern);
+    json_path_reset(intern);
+}
+
+static uint64_t json_path_now_us(void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+/* Feeds slices of the session's input until it is used up or the deadline
+ * passes. Returns 0 on error, 1 when the input is used up and 2 when there
+ * is more to do (or a non-blocking stream has nothing to read yet). */
+static int json_path_session_run(json_path_object *intern, php_stream *stream,
+    uint64_t deadline)
+{
+    json_path_session *session = &intern->session;
+    ssize_t amt_read;
+    size_t len;
+
+    for (;;) {
+        if (intern->decoder.paused) {
+            /* the rest of the last slice, which is still in buf or input */
+            if (!json_path_parse_resume(intern)) {
+                return 0;
+            }
+        } else if (stream) {
+            if (php_stream_eof(stream)) {
+                return 1;
+            }
+
+            if (!session->buf) {
+                session->buf = emalloc(JSON_PATH_SLICE_SIZE);
+            }
+
+            amt_read = php_stream_read(stream, (char *) session->buf,
+                JSON_PATH_SLICE_SIZE);
+
+            if (amt_read < 0) {
+                return 1;
+            }
+
+            if (amt_read == 0) {
+                return php_stream_eof(stream) ? 1 : 2;
+            }
+
+            if (!json_path_parse_chunk(intern, session->buf, amt_read)) {
+                return 0;
+            }
+        } else {
+            len = Z_STRLEN(session->input) - session->offset;
+
+            if (len == 0) {
+                return 1;
+            }
+
+            len = MIN(len, JSON_PATH_SLICE_SIZE);
+
+            if (!json_path_parse_chunk(intern, (const unsigned char *)
+                Z_STRVAL(session->input) + session->offset, len)) {
+                return 0;
+            }
+
+            session->offset += len;
+        }
+
+        if (json_path_now_us() >= deadline) {
+            return 2;
+        }
+    }
+}
+
+/* A tape is a document tokenized once into a flat token stream:
+ * "\0JPT", a u32 version, then tokens of a one-byte tag and a payload.
+ * 'i' and 'd' carry 8 bytes, 's' a u32 length and the bytes, '{' and '['
+ * the u32 distance from after it to their '}' or ']'. Keys are 's' tokens
+ * in key position. Replaying it drives the same callbacks as the
+ * tokenizer but jumps over containers no path can reach. */
+#define JSON_PATH_TAPE_MAGIC "\0JPT"
+#define JSON_PATH_TAPE_VERSION 1
+#define JSON_PATH_TAPE_HEADER_SIZE 8
+/* The container is too large to jump over */
+#define JSON_PATH_TAPE_NO_SKIP UINT32_MAX
+
+/* A persistent builder only uses the system allocator, so it can run off
+ * the PHP thread. frames holds the offsets of the open containers' skip
+ * fields. */
+typedef struct json_path_tape_builder {
+    smart_str out;
+    size_t *frames;
+    int depth;
+    int frames_size;
+    int persistent;
+    yajl_handle yh;
+} json_path_tape_builder;
+
+static void json_path_tape_builder_init(json_path_tape_builder *b,
+    int persistent)
+{
+    unsigned char header[JSON_PATH_TAPE_HEADER_SIZE];
+
+    memset(b, 0, sizeof(*b));
+    b->persistent = persistent;
+    b->frames_size = JSON_PATH_STACK_SIZE;
+    b->frames = pemalloc(b->frames_size * sizeof(size_t), persistent);
+
+    memcpy(header, JSON_PATH_TAPE_MAGIC, 4);
+    json_path_put_u32(header + 4, JSON_PATH_TAPE_VERSION);
+    smart_str_appendl_ex(&b->out, (const char *) header, sizeof(header),
+        persistent);
+}
+
+/* Frees everything but the tape itself */
+static void json_path_tape_builder_free(json_path_tape_builder *b)
+{
+    pefree(b->frames, b->persistent);
+    b->frames = NULL;
+}
+
+static inline int json_path_is_tape(const char *val, size_t len)
+{
+    return len >= JSON_PATH_TAPE_HEADER_SIZE &&
+        memcmp(val, JSON_PATH_TAPE_MAGIC, 4) == 0;
+}
+
+static int json_path_tape_token(json_path_tape_builder *b, char tag,
+    uint64_t payload, size_t payload_len)
+{
+    unsigned char buf[9];
+
+    buf[0] = tag;
+    if (payload_len == 8) {
+        json_path_put_u64(buf + 1, payload);
+    } else if (payload_len == 4) {
+        json_path_put_u32(buf + 1, (uint32_t) payload);
+    }
+
+    smart_str_appendl_ex(&b->out, (const char *) buf, 1 + payload_len,
+        b->persistent);
+
+    return 1;
+}
+
+static int json_path_tape_on_null(void *ctx)
+{
+    return json_path_tape_token(ctx, 'n', 0, 0);
+}
+
+static int json_path_tape_on_boolean(void *ctx, int val)
+{
+    return json_path_tape_token(ctx, val ? 't' : 'f', 0, 0);
+}
+
+static int json_path_tape_on_integer(void *ctx, long long val)
+{
+    return json_path_tape_token(ctx, 'i', (uint64_t) val, 8);
+}
+
+static int json_path_tape_on_double(void *ctx, double val)
+{
+    uint64_t bits;
+
+    memcpy(&bits, &val, sizeof(bits));
+
+    return json_path_tape_token(ctx, 'd', bits, 8);
+}
+
+static int json_path_tape_on_string(void *ctx, const unsigned char *val,
+    size_t val_len)
+{
+    json_path_tape_builder *b = (json_path_tape_builder *) ctx;
+
+    if (val_len > UINT32_MAX) {
+        return 0;
+    }
+
+    json_path_tape_token(b, 's', val_len, 4);
+    smart_str_appendl_ex(&b->out, (const char *) val, val_len, b->persistent);
+
+    return 1;
+}
+
+static int json_path_tape_start(json_path_tape_builder *b, char tag)
+{
+    size_t offset;
+
+    json_path_tape_token(b, tag, 0, 4);
+    offset = ZSTR_LEN(b->out.s) - 4;
+
+    if (b->depth == b->frames_size) {
+        b->frames_size *= 2;
+        b->frames = perealloc(b->frames, b->frames_size * sizeof(size_t),
+            b->persistent);
+    }
+    b->frames[b->depth++] = offset;
+
+    return 1;
+}
+
+static int json_path_tape_end(json_path_tape_builder *b, char tag)
+{
+    size_t offset = b->frames[--b->depth];
+    size_t distance = ZSTR_LEN(b->out.s) - offset - 4;
+
+    json_path_put_u32((unsigned char *) ZSTR_VAL(b->out.s) + offset,
+        distance < JSON_PATH_TAPE_NO_SKIP ? (uint32_t) distance :
+        JSON_PATH_TAPE_NO_SKIP);
+
+    return json_path_tape_token(b, tag, 0, 0);
+}
+
+static int json_path_tape_on_start_map(void *ctx)
+{
+    return json_path_tape_start(ctx, '{');
+}
+
+static int json_path_tape_on_end_map(void *ctx)
+{
+    return json_path_tape_end(ctx, '}');
+}
+
+static int json_path_tape_on_start_array(void *ctx)
+{
+    return json_path_tape_start(ctx, '[');
+}
+
+static int json_path_tape_on_end_array(void *ctx)
+{
+    return json_path_tape_end(ctx, ']');
+}
+
+static yajl_callbacks json_path_tape_yajl_callbacks = {
+    json_path_tape_on_null,
+    json_path_tape_on_boolean,
+    json_path_tape_on_integer,
+    json_path_tape_on_double,
+    NULL,
+    json_path_tape_on_string,
+    json_path_tape_on_start_map,
+    json_path_tape_on_string,
+    json_path_tape_on_end_map,
+    json_path_tape_on_start_array,
+    json_path_tape_on_end_array
+};
+
+static int json_path_tape_feed(void *ctx, const unsigned char *buf,
+    size_t len)
+{
+    json_path_tape_builder *b = (json_path_tape_builder *) ctx;
+
+    return yajl_parse(b->yh, buf, len) == yajl_status_ok;
+}
+
+/* Whether nothing inside the container that was just opened can match:
+ * no path is collecting and none continues below its parent */
+static int json_path_tape_can_skip(json_path_object *intern)
+{
+    json_path_stack_elem *top;
+    int i, j, depth = intern->path_stack.len;
+
+    if (intern->profile) {
+        return 0;
+    }
+
+    top = simple_vector_get_last(&intern->path_stack, json_path_stack_elem);
+
+    for (i=0; i < intern->paths.len; i++) {
+        json_path *curr = simple_vector_get(&intern->paths, json_path, i);
+        json_path_component *c;
+
+        if (curr->status == STATUS_COLLECTING) {
+            return 0;
+        }
+
+        if (curr->components.len < depth) {
+            continue;
+        }
+
+        c = simple_vector_get(&curr->components, json_path_component,
+            depth - 1);
+        if (c->type != (top->type == TYPE_ARRAY ? COMPONENT_ARRAY_KEY :
+            COMPONENT_MAP_KEY)) {
+            continue;
+        }
+
+        for (j=0; j < depth - 1; j++) {
+            if (!json_path_check_match(simple_vector_get(&curr->components,
+                json_path_component, j), simple_vector_get(&intern->path_stack,
+                json_path_stack_elem, j))) {
+                break;
+            }
+        }
+
+        if (j == depth - 1) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void json_path_tape_begin(json_path_object *intern)
+{
+    json_path_binary_reset(&intern->binary);
+    intern->yh = NULL;
+    json_path_values_begin(intern);
+}
+
+/* Replays the tokens in [p, end); a document may span several calls */
+static int json_path_tape_replay(json_path_object *intern,
+    const unsigned char *p, const unsigned char *end)
+{
+    json_path_binary *b = &intern->binary;
+    json_path_binary_frame *top;
+    uint64_t bits;
+    uint32_t n;
+    double d;
+    int ok = 1;
+
+    while (ok && p < end) {
+        char tag = *p++;
+
+        switch (tag) {
+            case 'n':
+                ok = json_path_binary_scalar(intern, IS_NULL, 0);
+                break;
+            case 't':
+            case 'f':
+                ok = json_path_binary_scalar(intern,
+                    tag == 't' ? IS_TRUE : IS_FALSE, 0);
+                break;
+            case 'i':
+            case 'd':
+                if (end - p < 8) {
+                    ok = 0;
+                    break;
+                }
+                bits = json_path_get_u64(p);
+                p += 8;
+                if (tag == 'i') {
+                    ok = json_path_binary_integer(intern, (int64_t) bits);
+                } else {
+                    memcpy(&d, &bits, sizeof(d));
+                    ok = json_path_binary_scalar(intern, IS_DOUBLE, d);
+                }
+                break;
+            case 's':
+                if (end - p < 4 || (n = json_path_get_u32(p)) >
+                    (size_t) (end - p) - 4) {
+                    ok = 0;
+                    break;
+                }
+                ok = json_path_binary_string(intern, p + 4, n);
+                p += 4 + n;
+                break;
+            case '{':
+            case '[':
+                if (end - p < 4) {
+                    ok = 0;
+                    break;
+                }
+                n = json_path_get_u32(p);
+                p += 4;
+                ok = json_path_binary_start(intern, tag == '{', -1);
+                if (ok && n != JSON_PATH_TAPE_NO_SKIP &&
+                    json_path_tape_can_skip(intern)) {
+                    if (n >= (size_t) (end - p) ||
+                        p[n] != (tag == '{' ? '}' : ']')) {
+                        ok = 0;
+                        break;
+                    }
+                    p += n;
+                }
+                break;
+            case '}':
+            case ']':
+                top = json_path_binary_top(b);
+                if (!top || top->is_map != (tag == '}')) {
+                    ok = 0;
+                    break;
+                }
+                ok = json_path_binary_end(intern);
+                break;
+            default:
+                ok = 0;
+                break;
+        }
+    }
+
+    return ok;
+}
+
+static int json_path_tape_finish(json_path_object *intern, int ok)
+{
+    if (!ok || !json_path_binary_finish(intern)) {
+        php_error_docref(NULL, E_WARNING, "%s", intern->binary.error ?
+            intern->binary.error : "Malformed tape");
+        return 0;
+    }
 
     return 1;
 }
 
-static yajl_callbacks json_path_yajl_callbacks = {
-    json_path_on_null,
-    json_path_on_boolean,
-    json_path_on_integer,
-    json_path_on_double,
-    NULL,
-    json_path_on_string,
-    json_path_on_start_map,
-    json_path_on_map_key,
-    json_path_on_end_map,
-    json_path_on_start_array,
-    json_path_on_end_array
-};
+static int json_path_parse_tape(json_path_object *intern,
+    const unsigned char *tape, size_t len)
+{
+    if (json_path_get_u32(tape + 4) != JSON_PATH_TAPE_VERSION) {
+        php_error_docref(NULL, E_WARNING, "Unsupported tape version");
+        return 0;
+    }
+
+    json_path_tape_begin(intern);
+
+    return json_path_tape_finish(intern, json_path_tape_replay(intern,
+        tape + JSON_PATH_TAPE_HEADER_SIZE, tape + len));
+}
+
+#ifdef HAVE_JSON_PATH_THREADS
+/* Parallel parsing of one large top-level array: a quote- and
+ * bracket-aware pre-scan splits it at commas between its elements, and
+ * worker threads tokenize the pieces, each wrapped as an array of its
+ * own, into tapes. zvals and PHP callbacks can only be made on the PHP
+ * thread, so it replays the tapes in document order as they complete,
+ * inside the single root array, so indexes and paths continue across
+ * pieces. At most parallelism pieces are in flight at a time. */
+#define JSON_PATH_PARALLEL_CHUNK_SIZE (4 * 1024 * 1024)
+
+typedef struct json_path_split_scan {
+    const unsigned char *json;
+    size_t len;
+    size_t pos;
+    int depth;
+    int in_string;
+} json_path_split_scan;
+
+typedef struct json_path_parallel_chunk {
+    pthread_t thread;
+    const unsigned char *start;
+    size_t len;
+    int first;
+    int last;
+    int started;
+    int ok;
+    json_path_tape_builder tape;
+} json_path_parallel_chunk;
+
+/* Returns the offset of the first comma between root array elements at or
+ * after target, or len when there is none */
+static size_t json_path_split_next(json_path_split_scan *s, size_t target)
+{
+    const unsigned char *json = s->json;
+    size_t i;
+
+    for (i = s->pos; i < s->len; i++) {
+        unsigned char c = json[i];
+
+        if (s->in_string) {
+            if (c == '\\') {
+                i++;
+            } else if (c == '"') {
+                s->in_string = 0;
+            }
+            continue;
+        }
+
+        switch (c) {
+            case '"':
+                s->in_string = 1;
+                break;
+            case '[':
+            case '{':
+                s->depth++;
+                break;
+            case ']':
+            case '}':
+                s->depth--;
+                break;
+            case ',':
+                if (s->depth == 1 && i >= target) {
+                    s->pos = i + 1;
+                    return i;
+                }
+                break;
+        }
+    }
+
+    s->pos = s->len;
+
+    return s->len;
+}
+
+static void *json_path_parallel_main(void *arg)
+{
+    json_path_parallel_chunk *c = (json_path_parallel_chunk *) arg;
+    json_path_tape_builder *b = &c->tape;
+
+    json_path_tape_builder_init(b, 1);
+    b->yh = yajl_alloc(&json_path_tape_yajl_callbacks, NULL, (void *) b);
+
+    c->ok = (c->first || yajl_parse(b->yh, (const unsigned char *) "[", 1) ==
+        yajl_status_ok) &&
+        yajl_parse(b->yh, c->start, c->len) == yajl_status_ok &&
+        (c->last || yajl_parse(b->yh, (const unsigned char *) "]", 1) ==
+        yajl_status_ok) &&
+        yajl_complete_parse(b->yh) == yajl_status_ok;
+
+    yajl_free(b->yh);
+    json_path_tape_builder_free(b);
+
+    return NULL;
+}
+
+static void json_path_parallel_start(json_path_parallel_chunk *c)
+{
+    c->started = json_path_thread_start(&c->thread, json_path_parallel_main,
+        c);
+
+    if (!c->started) {
+        json_path_parallel_main(c);
+    }
+}
+
+static void json_path_parallel_wait(json_path_parallel_chunk *c)
+{
+    if (c->started) {
+        pthread_join(c->thread, NULL);
+        c->started = 0;
+    }
+}
+
+static void json_path_parallel_free(json_path_parallel_chunk *c)
+{
+    if (c->tape.out.s) {
+        zend_string_free(c->tape.out.s);
+        c->tape.out.s = NULL;
+    }
+}
+
+static int json_path_parallel_eligible(json_path_object *intern,
+    const char *json, size_t len)
+{
+    size_t i = 0;
+
+    if (intern->parallelism < 2 || intern->format != JSON_PATH_FORMAT_JSON ||
+        intern->transform || len < 2 * JSON_PATH_PARALLEL_CHUNK_SIZE) {
+        return 0;
+    }
+
+    while (i < len && (json[i] == ' ' || json[i] == '\t' ||
+        json[i] == '\n' || json[i] == '\r')) {
+        i++;
+    }
+
+    return i < len && json[i] == '[';
+}
+
+/* Replays the part of a piece's tape that belongs to the document: the
+ * brackets a worker added around a piece are left out */
+static int json_path_parallel_replay(json_path_object *intern,
+    json_path_parallel_chunk *c)
+{
+    unsigned char *p = (unsigned char *) ZSTR_VAL(c->tape.out.s) +
+        JSON_PATH_TAPE_HEADER_SIZE;
+    unsigned char *end = (unsigned char *) ZSTR_VAL(c->tape.out.s) +
+        ZSTR_LEN(c->tape.out.s);
+
+    /* "[1,]" must not pass as "[1]" plus "[]": every piece holds at least
+     * one element */
+    if ((end - p < 6 || p[5] == ']') && !(c->first && c->last)) {
+        return 0;
+    }
 
-static void * json_path_yajl_malloc(void *ctx, size_t sz)
+    if (c->first) {
+        /* the root array cannot be jumped over, it ends in another piece */
+        json_path_put_u32(p + 1, JSON_PATH_TAPE_NO_SKIP);
+    } else {
+        p += 5;
+    }
+
+    if (!c->last) {
+        end--;
+    }
+
+    return json_path_tape_replay(intern, p, end);
+}
+
+static int json_path_parse_parallel(json_path_object *intern,
+    const char *json, size_t len)
 {
-    return emalloc(sz);
+    json_path_split_scan scan;
+    json_path_parallel_chunk *chunks, *c;
+    size_t start = 0, split;
+    int n = intern->parallelism, head = 0, running = 0, more = 1, ok = 1;
+
+    memset(&scan, 0, sizeof(scan));
+    scan.json = (const unsigned char *) json;
+    scan.len = len;
+
+    chunks = ecalloc(n, sizeof(json_path_parallel_chunk));
+
+    json_path_tape_begin(intern);
+
+    while (ok && (running > 0 || more)) {
+        while (more && running < n) {
+            c = &chunks[(head + running) % n];
+            split = json_path_split_next(&scan,
+                start + JSON_PATH_PARALLEL_CHUNK_SIZE);
+
+            c->start = (const unsigned char *) json + start;
+            c->len = split - start;
+            c->first = start == 0;
+            c->last = split == len;
+            c->ok = 0;
+            json_path_parallel_start(c);
+
+            more = !c->last;
+            start = split + 1;
+            running++;
+        }
+
+        c = &chunks[head];
+        json_path_parallel_wait(c);
+        head = (head + 1) % n;
+        running--;
+
+        if (!c->ok || !json_path_parallel_replay(intern, c)) {
+            php_error_docref(NULL, E_WARNING, "%s", intern->binary.error ?
+                intern->binary.error : "Failed parsing JSON");
+            ok = 0;
+        }
+
+        json_path_parallel_free(c);
+    }
+
+    /* after a failure the pieces still in flight are discarded */
+    while (running > 0) {
+        c = &chunks[head];
+        json_path_parallel_wait(c);
+        json_path_parallel_free(c);
+        head = (head + 1) % n;
+        running--;
+    }
+
+    efree(chunks);
+
+    return ok && json_path_tape_finish(intern, 1);
 }
 
-static void json_path_yajl_free(void *ctx, void *ptr)
+/* Plain files are mapped instead of read, so the pieces need no copies.
+ * Returns -1 when the stream is not parsed this way. */
+static int json_path_parse_mapped(json_path_object *intern,
+    php_stream *stream)
 {
-    efree(ptr);
+    char *mapped;
+    size_t mapped_len;
+    int status;
+
+    if (intern->parallelism < 2 || !php_stream_mmap_possible(stream)) {
+        return -1;
+    }
+
+    mapped = php_stream_mmap_range(stream, php_stream_tell(stream),
+        PHP_STREAM_MMAP_ALL, PHP_STREAM_MAP_MODE_SHARED_READONLY,
+        &mapped_len);
+    if (!mapped) {
+        return -1;
+    }
+
+    if (!json_path_parallel_eligible(intern, mapped, mapped_len)) {
+        php_stream_mmap_unmap(stream);
+        return -1;
+    }
+
+    status = json_path_parse_parallel(intern, mapped, mapped_len);
+
+    /* leaves the stream at its end, as reading it would */
+    php_stream_mmap_unmap_ex(stream, mapped_len);
+
+    return status;
 }
+#endif
 
-static void * json_path_yajl_realloc(void *ctx, void *ptr, size_t sz)
+static int json_path_parse_input(json_path_object *intern, zval *z,
+    zend_string *index_file)
 {
-    return erealloc(ptr, sz);
+    php_stream *stream;
+    int status;
+
+    switch (Z_TYPE_P(z)) {
+        case IS_STRING:
+            if (json_path_is_tape(Z_STRVAL_P(z), Z_STRLEN_P(z))) {
+                if (index_file || intern->transform) {
+                    php_error_docref(NULL, E_WARNING,
+                        "A tape cannot be used with an index or transformed");
+                    return 0;
+                }
+                status = json_path_parse_tape(intern,
+                    (const unsigned char *) Z_STRVAL_P(z), Z_STRLEN_P(z));
+            } else if (index_file) {
+                status = json_path_parse_indexed(intern, Z_STRVAL_P(z),
+                    Z_STRLEN_P(z), NULL, index_file);
+#ifdef HAVE_JSON_PATH_THREADS
+            } else if (json_path_parallel_eligible(intern, Z_STRVAL_P(z),
+                Z_STRLEN_P(z))) {
+                status = json_path_parse_parallel(intern, Z_STRVAL_P(z),
+                    Z_STRLEN_P(z));
+#endif
+            } else {
+                status = json_path_parse_string(intern, Z_STRVAL_P(z),
+                    Z_STRLEN_P(z));
+            }
+            break;
+        case IS_RESOURCE:
+            /* warns, or throws on PHP 8, like php_stream_from_zval() */
+            stream = (php_stream *) zend_fetch_resource2_ex(z, "stream",
+                php_file_le_stream(), php_file_le_pstream());
+            if (!stream) {
+                return 0;
+            }
+            if (index_file) {
+                status = json_path_parse_indexed(intern, NULL, 0, stream,
+                    index_file);
+#ifdef HAVE_JSON_PATH_THREADS
+            } else if ((status = json_path_parse_mapped(intern, stream)) >= 0) {
+                /* a plain file, parsed in parallel */
+#endif
+            } else {
+                status = json_path_parse_stream(intern, stream);
+            }
+            break;
+        default:
+            php_error_docref(NULL, E_WARNING,
+                "Parameter was not a string or resource");
+            return 0;
+    }
+
+    return status;
 }
 
-static yajl_alloc_funcs json_path_yajl_alloc_funcs = {
-    json_path_yajl_malloc,
-    json_path_yajl_realloc,
-    json_path_yajl_free,
-    NULL
-};
+static int json_path_parse_zval(json_path_object *intern, zval *z,
+    zend_string *index_file)
+{
+    int status;
+
+    if (intern->session.active) {
+        json_path_session_abort(intern);
+    }
 
-static int json_path_parse_string(json_path_object *intern, char *json, int json_len)
+    if (index_file && intern->format != JSON_PATH_FORMAT_JSON) {
+        php_error_docref(NULL, E_WARNING,
+            "An index can only be used with JSON input");
+        return 0;
+    }
+
+    /* whatever a failed parse left on the stacks would be matched against */
+    json_path_reset(intern);
+    json_path_aggregate_reset(intern);
+
+    intern->in_parse = 1;
+
+    status = json_path_parse_input(intern, z, index_file);
+
+    json_path_intern_clear(&intern->strings);
+
+    if (status && !intern->transform && !intern->profile) {
+        json_path_aggregate_deliver(intern);
+    }
+
+    intern->in_parse = 0;
+
+    return status;
+}
+
+PHP_METHOD(JsonPath, parse)
 {
-    yajl_handle yh;
-    yajl_status ys;
+    FETCH_THIS_AND_INTERN();
+    zval *z;
+    zend_string *index_file = NULL;
 
-    yh = yajl_alloc(&json_path_yajl_callbacks, 
-        &json_path_yajl_alloc_funcs, (void *) intern);
+    if (SUCCESS != zend_parse_parameters(ZEND_NUM_ARGS(), "z|P!", &z,
+        &index_file)) {
+        RETURN_FALSE;
+    }
+
+    if (!json_path_check_idle(intern)) {
+        RETURN_FALSE;
+    }
 
-    ys = yajl_parse(yh, json, json_len);
+    RETURN_BOOL(json_path_parse_zval(intern, z, index_file));
+}
 
-    if (ys != yajl_status_ok) {
-        php_error_docref(NULL TSRMLS_CC, E_WARNING, 
-            "Failed parsing JSON");
-        yajl_free(yh);
-        return 0;
+PHP_METHOD(JsonPath, parseFor)
+{
+    FETCH_THIS_AND_INTERN();
+    json_path_session *session = &intern->session;
+    php_stream *stream = NULL;
+    zend_long budget;
+    uint64_t deadline;
+    zval *z;
+    int status;
+
+    if (SUCCESS != zend_parse_parameters(ZEND_NUM_ARGS(), "zl", &z,
+        &budget)) {
+        RETURN_FALSE;
     }
 
-    ys = yajl_complete_parse(yh);
+    if (!json_path_check_idle(intern)) {
+        RETURN_FALSE;
+    }
 
-    if (ys != yajl_status_ok) {
-        php_error_docref(NULL TSRMLS_CC, E_WARNING, 
-            "Failed parsing JSON");
-        yajl_free(yh);
-        return 0;
+    if (Z_TYPE_P(z) == IS_RESOURCE) {
+        php_stream_from_zval(stream, z);
+    } else if (Z_TYPE_P(z) != IS_STRING) {
+        php_error_docref(NULL, E_WARNING,
+            "Parameter was not a string or resource");
+        RETURN_FALSE;
     }
 
-    yajl_free(yh);
+    /* Replaying a tape does no lexing, so it is not sliced */
+    if (!stream && json_path_is_tape(Z_STRVAL_P(z), Z_STRLEN_P(z))) {
+        if (!json_path_parse_zval(intern, z, NULL)) {
+            json_path_reset(intern);
+            RETURN_FALSE;
+        }
+        RETURN_LONG(JSON_PATH_PARSE_COMPLETE);
+    }
 
-    return 1;
+    /* Passing other input than the unfinished one starts over */
+    if (session->active && (Z_TYPE(session->input) != Z_TYPE_P(z) ||
+        (stream ? Z_RES(session->input) != Z_RES_P(z) :
+        Z_STR(session->input) != Z_STR_P(z)))) {
+        json_path_session_abort(intern);
+    }
+
+    deadline = json_path_now_us() + (budget > 0 ? budget : 0);
+
+    if (!session->active) {
+        json_path_reset(intern);
+        json_path_aggregate_reset(intern);
+        json_path_parse_begin(intern);
+        intern->decoder.out_limit = JSON_PATH_SLICE_OUTPUT_SIZE;
+        ZVAL_COPY(&session->input, z);
+        session->offset = 0;
+        session->active = 1;
+    }
+
+    intern->in_parse = 1;
+
+    status = json_path_session_run(intern, stream, deadline);
+
+    if (status == 2) {
+        intern->in_parse = 0;
+        RETURN_LONG(JSON_PATH_PARSE_INCOMPLETE);
+    }
+
+    if (status == 1) {
+        status = json_path_parse_end(intern);
+    }
+
+    json_path_session_end(intern);
+
+    if (!status) {
+        json_path_reset(intern);
+        intern->in_parse = 0;
+        RETURN_FALSE;
+    }
+
+    json_path_aggregate_deliver(intern);
+
+    intern->in_parse = 0;
+
+    RETURN_LONG(JSON_PATH_PARSE_COMPLETE);
 }
 
-static int json_path_parse_stream(json_path_object *intern, php_stream *stream)
+PHP_METHOD(JsonPath, extract)
 {
-    yajl_handle yh;
-    yajl_status ys;
-    char buf[4096];
-    size_t amt_read;
+    FETCH_THIS_AND_INTERN();
+    zval *z;
+    zend_string *index_file = NULL;
+    int i, status;
 
-    yh = yajl_alloc(&json_path_yajl_callbacks, 
-        &json_path_yajl_alloc_funcs, (void *) intern);
+    if (SUCCESS != zend_parse_parameters(ZEND_NUM_ARGS(), "z|P!", &z,
+        &index_file)) {
+        RETURN_FALSE;
+    }
 
-    while (!php_stream_eof(stream)) {
-        amt_read = php_stream_read(stream, buf, sizeof(buf));
+    if (!json_path_check_idle(intern)) {
+        RETURN_FALSE;
+    }
 
-        if (amt_read < 0) {
-            break;
+    array_init(return_value);
+
+    for (i=0; i < intern->paths.len; i++) {
+        json_path *path = simple_vector_get(&intern->paths, json_path, i);
+
+        if (path->wildcard && !path->aggregate) {
+            zval matches;
+
+            array_init(&matches);
+            zend_symtable_update(Z_ARRVAL_P(return_value), path->name,
+                &matches);
         }
+    }
 
-        ys = yajl_parse(yh, buf, amt_read);
+    intern->results = return_value;
+    status = json_path_parse_zval(intern, z, index_file);
+    intern->results = NULL;
 
-        if (ys != yajl_status_ok) {
-            php_error_docref(NULL TSRMLS_CC, E_WARNING, 
-                "Failed parsing JSON");
-            yajl_free(yh);
-            return 0;
+    if (!status) {
+        zval_ptr_dtor(return_value);
+        RETURN_FALSE;
+    }
+}
+
+PHP_METHOD(JsonPath, tape)
+{
+    zval *z;
+    json_path_tape_builder b;
+    json_path_decoder decoder;
+    php_stream *stream = NULL;
+    unsigned char *buf;
+    ssize_t amt_read;
+    int ok;
+
+    if (SUCCESS != zend_parse_parameters(ZEND_NUM_ARGS(), "z", &z)) {
+        RETURN_FALSE;
+    }
+
+    if (Z_TYPE_P(z) == IS_RESOURCE) {
+        php_stream_from_zval(stream, z);
+    } else if (Z_TYPE_P(z) != IS_STRING) {
+        php_error_docref(NULL, E_WARNING,
+            "Parameter was not a string or resource");
+        RETURN_FALSE;
+    }
+
+    json_path_tape_builder_init(&b, 0);
+    b.yh = yajl_alloc(&json_path_tape_yajl_callbacks,
+        &json_path_yajl_alloc_funcs, (void *) &b);
+    json_path_decoder_init(&decoder, json_path_tape_feed, &b);
+
+    if (stream) {
+        ok = 1;
+        buf = emalloc(JSON_PATH_READ_BUFFER_SIZE);
+
+        while (ok && !php_stream_eof(stream)) {
+            amt_read = php_stream_read(stream, (char *) buf,
+                JSON_PATH_READ_BUFFER_SIZE);
+
+            if (amt_read <= 0) {
+                break;
+            }
+
+            ok = json_path_decoder_feed(&decoder, buf, amt_read);
         }
+
+        efree(buf);
+    } else {
+        ok = json_path_decoder_feed(&decoder,
+            (const unsigned char *) Z_STRVAL_P(z), Z_STRLEN_P(z));
     }
 
-    ys = yajl_complete_parse(yh);
+    ok = ok && json_path_decoder_finish(&decoder) &&
+        yajl_complete_parse(b.yh) == yajl_status_ok;
 
-    if (ys != yajl_status_ok) {
-        php_error_docref(NULL TSRMLS_CC, E_WARNING, 
-            "Failed parsing JSON");
-        yajl_free(yh);
-        return 0;
+    if (!ok) {
+        php_error_docref(NULL, E_WARNING, "%s", decoder.error ?
+            decoder.error : "Failed parsing JSON");
     }
 
-    yajl_free(yh);
+    json_path_decoder_free(&decoder);
+    yajl_free(b.yh);
+    json_path_tape_builder_free(&b);
 
-    return 1;
+    if (!ok) {
+        smart_str_free(&b.out);
+        RETURN_FALSE;
+    }
+
+    smart_str_0(&b.out);
+    RETURN_NEW_STR(b.out.s);
 }
 
-PHP_METHOD(JsonPath, parse)
+PHP_METHOD(JsonPath, transform)
 {
     FETCH_THIS_AND_INTERN();
-    zval *z;
-    php_stream *stream;
+    zval *z, *zout, *replacement = NULL;
+    zend_long mode;
+    json_path_transform t;
+    char *error = NULL;
+    int status;
+
+    if (SUCCESS != zend_parse_parameters(ZEND_NUM_ARGS(), "zrl|z!", &z,
+        &zout, &mode, &replacement)) {
+        RETURN_FALSE;
+    }
 
-    if (SUCCESS != zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "z", &z)) {
+    if (!json_path_check_idle(intern)) {
         RETURN_FALSE;
     }
 
-    switch (Z_TYPE_P(z)) {
-        case IS_STRING:
-            RETURN_BOOL(json_path_parse_string(intern,
-                Z_STRVAL_P(z), Z_STRLEN_P(z)));
+    if (intern->format != JSON_PATH_FORMAT_JSON) {
+        php_error_docref(NULL, E_WARNING,
+            "Only JSON input can be transformed");
+        RETURN_FALSE;
+    }
+
+    memset(&t, 0, sizeof(t));
+    t.mode = mode;
+    t.skip_comma_depth = -1;
+
+    php_stream_from_zval(t.out, zout);
+
+    switch (mode) {
+        case JSON_PATH_TRANSFORM_REMOVE:
             break;
-        case IS_RESOURCE:
-            php_stream_from_zval(stream, &z);
-            RETURN_BOOL(json_path_parse_stream(intern, stream));
+        case JSON_PATH_TRANSFORM_REPLACE:
+            if (!replacement) {
+                php_error_docref(NULL, E_WARNING,
+                    "A replacement value is required");
+                RETURN_FALSE;
+            }
+            if (!json_path_transform_encode(&t.replacement, replacement)) {
+                smart_str_free(&t.replacement);
+                RETURN_FALSE;
+            }
+            break;
+        case JSON_PATH_TRANSFORM_CALLBACK:
+            if (!replacement || SUCCESS != zend_fcall_info_init(replacement,
+                0, &t.callback.fci, &t.callback.fcc, NULL, &error)) {
+                if (error) {
+                    efree(error);
+                }
+                php_error_docref(NULL, E_WARNING,
+                    "Replacement is not callable");
+                RETURN_FALSE;
+            }
+            if (error) {
+                efree(error);
+            }
             break;
         default:
-            php_error_docref(NULL TSRMLS_CC, E_WARNING, 
-                "Parameter was not a string or resource");
+            php_error_docref(NULL, E_WARNING, "Unknown transform mode");
             RETURN_FALSE;
     }
+
+    intern->transform = &t;
+    status = json_path_parse_zval(intern, z, NULL);
+    intern->transform = NULL;
+
+    if (status) {
+        json_path_transform_flush(&t, t.input_off);
+        if (t.out_buf.s && ZSTR_LEN(t.out_buf.s) > 0) {
+            php_stream_write(t.out, ZSTR_VAL(t.out_buf.s),
+                ZSTR_LEN(t.out_buf.s));
+        }
+    }
+
+    smart_str_free(&t.out_buf);
+    smart_str_free(&t.replacement);
+    if (t.pending) {
+        efree(t.pending);
+    }
+
+    RETURN_BOOL(status);
+}
+
+PHP_METHOD(JsonPath, profile)
+{
+    FETCH_THIS_AND_INTERN();
+    zval *z;
+    json_path_profile profile;
+    int status;
+
+    if (SUCCESS != zend_parse_parameters(ZEND_NUM_ARGS(), "z", &z)) {
+        RETURN_FALSE;
+    }
+
+    if (!json_path_check_idle(intern)) {
+        RETURN_FALSE;
+    }
+
+    json_path_profile_init(&profile);
+
+    intern->profile = &profile;
+    status = json_path_parse_zval(intern, z, NULL);
+    intern->profile = NULL;
+
+    if (status) {
+        if (profile.truncated) {
+            php_error_docref(NULL, E_NOTICE,
+                "More than %d distinct paths, the rest were not profiled",
+                JSON_PATH_PROFILE_MAX_PATHS);
+        }
+        json_path_profile_result(&profile, return_value);
+    }
+
+    json_path_profile_free(&profile);
+
+    if (!status) {
+        RETURN_FALSE;
+    }
+}
+
+PHP_METHOD(JsonPath, buildIndex)
+{
+    char *file, *index_file;
+    size_t file_len, index_file_len;
+    zend_long depth = 2;
+    json_path_index_builder b;
+    php_stream *in, *out;
+    php_stream_statbuf ssb;
+    unsigned char *buf;
+    ssize_t amt_read;
+    int ok = 1;
+
+    if (SUCCESS != zend_parse_parameters(ZEND_NUM_ARGS(), "pp|l", &file,
+        &file_len, &index_file, &index_file_len, &depth)) {
+        RETURN_FALSE;
+    }
+
+    if (depth < 1 || depth > JSON_PATH_INDEX_MAX_DEPTH) {
+        php_error_docref(NULL, E_WARNING, "Depth must be between 1 and %d",
+            JSON_PATH_INDEX_MAX_DEPTH);
+        RETURN_FALSE;
+    }
+
+    in = php_stream_open_wrapper(file, "rb", REPORT_ERRORS, NULL);
+    if (!in) {
+        RETURN_FALSE;
+    }
+
+    json_path_index_builder_init(&b, depth);
+    buf = emalloc(JSON_PATH_READ_BUFFER_SIZE);
+
+    if (php_stream_stat(in, &ssb) == 0) {
+        b.mtime = (uint64_t) ssb.sb.st_mtime;
+    }
+
+    while (ok && !php_stream_eof(in)) {
+        amt_read = php_stream_read(in, (char *) buf,
+            JSON_PATH_READ_BUFFER_SIZE);
+
+        if (amt_read <= 0) {
+            break;
+        }
+
+        /* Offsets must address the bytes the tokenizer will see */
+        if (b.offset == 0 && amt_read >= 2 && ((buf[0] == 0x1f &&
+            buf[1] == 0x8b) || (amt_read >= 4 && buf[0] == 0x28 &&
+            buf[1] == 0xb5 && buf[2] == 0x2f && buf[3] == 0xfd))) {
+            php_error_docref(NULL, E_WARNING,
+                "Compressed input cannot be indexed");
+            ok = 0;
+            break;
+        }
+
+        json_path_index_sample(&b, buf, amt_read);
+        json_path_index_scan(&b, buf, amt_read);
+    }
+
+    efree(buf);
+    php_stream_close(in);
+
+    if (ok && !json_path_index_finish(&b)) {
+        php_error_docref(NULL, E_WARNING, "Failed indexing %s: malformed JSON",
+            file);
+        ok = 0;
+    }
+
+    if (ok) {
+        out = php_stream_open_wrapper(index_file, "wb", REPORT_ERRORS, NULL);
+        if (!out) {
+            ok = 0;
+        } else {
+            if (!json_path_index_write(&b, out)) {
+                php_error_docref(NULL, E_WARNING, "Failed writing index %s",
+                    index_file);
+                ok = 0;
+            }
+            php_stream_close(out);
+        }
+    }
+
+    json_path_index_builder_free(&b);
+
+    RETURN_BOOL(ok);
 }
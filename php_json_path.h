@@ -1,7 +1,7 @@
 #ifndef PHP_JSON_PATH_H
 #define PHP_JSON_PATH_H
 
-#define PHP_JSON_PATH_VERSION "1.0.0"
+#define PHP_JSON_PATH_VERSION "2.0.0"
 
 extern zend_module_entry json_path_module_entry;
 #define phpext_json_path_ptr &json_path_module_entry
@@ -20,10 +20,10 @@ ZEND_BEGIN_MODULE_GLOBALS(json_path)
 
 ZEND_END_MODULE_GLOBALS(json_path)
 
-#ifdef ZTS
-# define JSON_PATH_G(v) TSRMG(json_path_globals_id, zend_json_path_globals *, v)
-#else
-# define JSON_PATH_G(v) (json_path_globals.v)
+#define JSON_PATH_G(v) ZEND_MODULE_GLOBALS_ACCESSOR(json_path, v)
+
+#if defined(ZTS) && defined(COMPILE_DL_JSON_PATH)
+ZEND_TSRMLS_CACHE_EXTERN()
 #endif
 
 #endif  /* PHP_JSON_PATH_H */
@@ -0,0 +1,64 @@
+--TEST--
+aggregate() reduces matched values without collecting them
+--SKIPIF--
+<?php if (!extension_loaded('json_path')) die('skip json_path not loaded'); ?>
+--FILE--
+<?php
+$json = '{"items":[{"price":3,"color":"red"},{"price":1.5,"color":"green"},' .
+    '{"price":10,"color":"blue"},{"price":"x","color":"red"},{"price":null}]}';
+
+function aggregate($json, $path, $op)
+{
+    $jp = new JsonPath();
+    $jp->aggregate($path, $op);
+    $r = $jp->extract($json);
+    return $r[$path];
+}
+
+var_dump(aggregate($json, 'items[*]', JsonPath::AGGREGATE_COUNT));
+var_dump(aggregate($json, 'items[*].price', JsonPath::AGGREGATE_COUNT));
+var_dump(aggregate($json, 'items[*].price', JsonPath::AGGREGATE_SUM));
+var_dump(aggregate($json, 'items[*].price', JsonPath::AGGREGATE_MIN));
+var_dump(aggregate($json, 'items[*].price', JsonPath::AGGREGATE_MAX));
+var_dump(round(aggregate($json, 'items[*].price', JsonPath::AGGREGATE_AVG),
+    2));
+var_dump(aggregate($json, 'items[*].color', JsonPath::AGGREGATE_DISTINCT));
+
+/* nothing matched */
+var_dump(aggregate($json, 'none[*]', JsonPath::AGGREGATE_COUNT));
+var_dump(aggregate($json, 'none[*]', JsonPath::AGGREGATE_MIN));
+var_dump(aggregate($json, 'none[*]', JsonPath::AGGREGATE_AVG));
+
+/* integer overflow continues as float */
+var_dump(aggregate('[' . PHP_INT_MAX . ',1]', '[*]',
+    JsonPath::AGGREGATE_SUM) == (float) PHP_INT_MAX + 1);
+
+/* callbacks get each aggregate once, after the document */
+$jp = new JsonPath();
+$jp->aggregate('items[*].price', JsonPath::AGGREGATE_SUM);
+$jp->addPath('items[4]');
+$jp->addCallback(function ($path, $value) {
+    echo $path, ' ', json_encode($value), "\n";
+});
+var_dump($jp->parse($json));
+
+var_dump($jp->aggregate('a', 0));
+?>
+--EXPECTF--
+int(5)
+int(5)
+float(14.5)
+float(1.5)
+int(10)
+float(4.83)
+int(3)
+int(0)
+NULL
+NULL
+bool(true)
+items[4] {"price":null}
+items[*].price 14.5
+bool(true)
+
+Warning: JsonPath::aggregate(): Unknown aggregate operation in %s on line %d
+bool(false)
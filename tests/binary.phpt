@@ -0,0 +1,72 @@
+--TEST--
+CBOR and MessagePack input match the same document as JSON
+--SKIPIF--
+<?php if (!extension_loaded('json_path')) die('skip json_path not loaded'); ?>
+--FILE--
+<?php
+function extract_as($format, $input)
+{
+    $jp = new JsonPath();
+    $jp->setInputFormat($format);
+    $jp->addPath('a[*]');
+    $jp->addPath('b');
+    $jp->addPath('b.c');
+    $r = $jp->extract($input);
+    if (is_array($r)) {
+        ksort($r);
+    }
+    return json_encode($r);
+}
+
+$json = extract_as(JsonPath::FORMAT_JSON,
+    '{"a":[1,-2,"x",true,null,1.5],"b":{"c":"d"}}');
+echo $json, "\n";
+
+$cbor = hex2bin('a261618601216178f5f6f93e006162a161636164');
+var_dump(extract_as(JsonPath::FORMAT_CBOR, $cbor) === $json);
+
+$msgpack = hex2bin('82a1619601fea178c3c0cb3ff8000000000000a16281a163a164');
+var_dump(extract_as(JsonPath::FORMAT_MSGPACK, $msgpack) === $json);
+
+/* indefinite lengths, a chunked string and an integer key */
+echo extract_as(JsonPath::FORMAT_CBOR,
+    hex2bin('bf61619f0102ff6162a1017f626162616360ffff')), "\n";
+
+/* a string longer than a read, so it is split across chunks */
+$big = str_repeat('x', 200000);
+$inputs = array(
+    JsonPath::FORMAT_CBOR => "\xa2\x61a\x81\x7a" . pack('N', 200000) . $big .
+        "\x61b\xa1\x61c\x01",
+    JsonPath::FORMAT_MSGPACK => "\x82\xa1a\x91\xdb" . pack('N', 200000) .
+        $big . "\xa1b\x81\xa1c\x01",
+);
+foreach ($inputs as $format => $input) {
+    $fp = fopen('php://memory', 'w+');
+    fwrite($fp, $input);
+    rewind($fp);
+    var_dump(extract_as($format, $fp) ===
+        json_encode(array('a[*]' => array($big), 'b' => array('c' => 1),
+        'b.c' => 1)));
+    fclose($fp);
+}
+
+var_dump(extract_as(JsonPath::FORMAT_CBOR, hex2bin('a26161')));
+var_dump(extract_as(JsonPath::FORMAT_CBOR, hex2bin('0101')));
+var_dump(extract_as(JsonPath::FORMAT_MSGPACK, hex2bin('c1')));
+?>
+--EXPECTF--
+{"a[*]":[1,-2,"x",true,null,1.5],"b":{"c":"d"},"b.c":"d"}
+bool(true)
+bool(true)
+{"a[*]":[1,2],"b":{"1":"abc"}}
+bool(true)
+bool(true)
+
+Warning: JsonPath::extract(): Unexpected end of input in %s on line %d
+string(5) "false"
+
+Warning: JsonPath::extract(): Trailing data after the top-level value in %s on line %d
+string(5) "false"
+
+Warning: JsonPath::extract(): Malformed MessagePack input in %s on line %d
+string(5) "false"
@@ -0,0 +1,29 @@
+--TEST--
+Callbacks receive the path and the collected value
+--SKIPIF--
+<?php
+if (!extension_loaded('json_path')) die('skip json_path not loaded');
+if (PHP_VERSION_ID < 70100) die('skip empty property names need PHP 7.1');
+?>
+--FILE--
+<?php
+$jp = new JsonPath();
+$jp->addPath('x');
+$jp->addPath('n');
+$jp->addPath('n[2]');
+$jp->addCallback(function ($path, $value) {
+    echo $path, ' ', json_encode($value), "\n";
+});
+
+var_dump($jp->parse('{"x":{"":1,"k":"v"},"n":[true,null,15]}'));
+
+$jp->setObjectsAsArrays(true);
+var_dump($jp->parse('{"x":{"k":[{"a":"b"}]}}'));
+?>
+--EXPECT--
+x {"":1,"k":"v"}
+n[2] 15
+n [true,null,15]
+bool(true)
+x {"k":[{"a":"b"}]}
+bool(true)
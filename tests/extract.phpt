@@ -0,0 +1,32 @@
+--TEST--
+JsonPath::extract() returns all matches keyed by path
+--SKIPIF--
+<?php if (!extension_loaded('json_path')) die('skip json_path not loaded'); ?>
+--FILE--
+<?php
+$jp = new JsonPath();
+$jp->addPath('a.b');
+$jp->addPath('a.c');
+$jp->addPath('items[*].p');
+$jp->addPath('none[*]');
+$jp->addPath('missing');
+
+$json = '{"a":{"b":1,"c":[1,2,3]},"items":[{"p":1},{"p":"x"}]}';
+
+$r = $jp->extract($json);
+ksort($r);
+echo json_encode($r), "\n";
+
+var_dump($jp->extract('{"a":'));
+
+/* a failed parse leaves nothing behind for the next one */
+$r = $jp->extract($json);
+ksort($r);
+echo json_encode($r), "\n";
+?>
+--EXPECTF--
+{"a.b":1,"a.c":[1,2,3],"items[*].p":[1,"x"],"none[*]":[]}
+
+Warning: JsonPath::extract(): Failed parsing JSON in %s on line %d
+bool(false)
+{"a.b":1,"a.c":[1,2,3],"items[*].p":[1,"x"],"none[*]":[]}
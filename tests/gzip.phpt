@@ -0,0 +1,33 @@
+--TEST--
+gzip input is decompressed while it is parsed
+--SKIPIF--
+<?php
+if (!extension_loaded('json_path')) die('skip json_path not loaded');
+if (!function_exists('gzencode')) die('skip zlib extension needed');
+$jp = new JsonPath();
+if (!@$jp->parse(gzencode('[1]'))) die('skip built without gzip support');
+?>
+--FILE--
+<?php
+$jp = new JsonPath();
+$jp->addPath('a[*]');
+
+echo json_encode($jp->extract(gzencode('{"a":[1,2,3]}'))), "\n";
+
+/* concatenated members, as pigz writes them */
+echo json_encode($jp->extract(gzencode('{"a":[1,') . gzencode('2]}'))), "\n";
+
+$fp = fopen('php://memory', 'w+');
+fwrite($fp, gzencode('{"a":[1,2,3]}'));
+rewind($fp);
+echo json_encode($jp->extract($fp)), "\n";
+
+var_dump($jp->extract(substr(gzencode('{"a":[1,2,3]}'), 0, -4)));
+?>
+--EXPECTF--
+{"a[*]":[1,2,3]}
+{"a[*]":[1,2]}
+{"a[*]":[1,2,3]}
+
+Warning: JsonPath::extract(): Unexpected end of compressed input in %s on line %d
+bool(false)
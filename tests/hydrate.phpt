@@ -0,0 +1,69 @@
+--TEST--
+Matches hydrate into classes and a typed property error stops the parse
+--SKIPIF--
+<?php
+if (!extension_loaded('json_path')) die('skip json_path not loaded');
+if (PHP_VERSION_ID < 70400) die('skip typed properties need PHP 7.4');
+?>
+--FILE--
+<?php
+class User
+{
+    public int $id;
+    public string $name;
+    public $tags = array();
+
+    public function __construct()
+    {
+        echo "constructor called\n";
+    }
+}
+
+class Team
+{
+    public $lead;
+    public $members;
+}
+
+$jp = new JsonPath();
+$jp->addPath('users[*]', 'User');
+$jp->addCallback(function ($path, $user) {
+    echo $path, ' ', get_class($user), ' ', var_export($user->id, true), ' ',
+        $user->name, ' ', json_encode($user->tags), "\n";
+});
+
+var_dump($jp->parse('{"users":[{"id":"5","name":"a","extra":1,"tags":[1]},' .
+    '{"id":3,"name":"c"}]}'));
+
+try {
+    $jp->parse('{"users":[{"id":1,"name":"a"},{"id":"x","name":"b"},' .
+        '{"id":3,"name":"c"}]}');
+    echo "not thrown\n";
+} catch (TypeError $e) {
+    echo get_class($e), "\n";
+}
+
+/* the failed parse leaves the object usable */
+var_dump($jp->parse('{"users":[{"id":7,"name":"d"}]}'));
+
+$jp = new JsonPath();
+$jp->addPath('team', 'Team', array('lead' => 'User', 'members[*]' => 'User'));
+$r = $jp->extract('{"team":{"lead":{"id":1,"name":"a"},' .
+    '"members":[{"id":2,"name":"b"}]}}');
+echo get_class($r['team']), ' ', get_class($r['team']->lead), ' ',
+    get_class($r['team']->members[0]), ' ', $r['team']->members[0]->id, "\n";
+
+var_dump($jp->addPath('x', 'Countable'));
+?>
+--EXPECTF--
+users[*] User 5 a [1]
+users[*] User 3 c []
+bool(true)
+users[*] User 1 a []
+TypeError
+users[*] User 7 d []
+bool(true)
+Team User User 2
+
+Warning: JsonPath::addPath(): Cannot instantiate Countable in %s on line %d
+bool(false)
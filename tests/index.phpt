@@ -0,0 +1,116 @@
+--TEST--
+An index gives the same matches and is refused when corrupt or stale
+--SKIPIF--
+<?php if (!extension_loaded('json_path')) die('skip json_path not loaded'); ?>
+--FILE--
+<?php
+$users = array();
+for ($i = 0; $i < 100; $i++) {
+    $users[] = sprintf('{"id":%d,"name":"user %d"}', $i, $i);
+}
+$json = '{"meta":{"count":100,"page":1},"users":[' . implode(',', $users) .
+    '],"tail":"x"}';
+
+$file = tempnam(sys_get_temp_dir(), 'jp');
+$index = $file . '.jpix';
+file_put_contents($file, $json);
+
+var_dump(JsonPath::buildIndex($file, $index));
+
+$jp = new JsonPath();
+$jp->addPath('meta.count');
+$jp->addPath('users[*].name');
+$jp->addPath('tail');
+
+$plain = $jp->extract($json);
+var_dump(count($plain['users[*].name']));
+var_dump($jp->extract($json, $index) === $plain);
+
+$fp = fopen($file, 'rb');
+var_dump($jp->extract($fp, $index) === $plain);
+fclose($fp);
+
+/* the first entry's end moved past the end of the source */
+$data = file_get_contents($index);
+file_put_contents($index, substr_replace($data, pack('P', 1 << 40), 56 + 24,
+    8));
+var_dump($jp->extract($json, $index));
+
+file_put_contents($index, 'JPXX' . substr($data, 4));
+var_dump($jp->extract($json, $index));
+
+/* same size, different bytes */
+file_put_contents($index, $data);
+$edited = str_replace('"tail":"x"', '"tail":"y"', $json);
+var_dump($jp->extract($edited, $index));
+
+file_put_contents($file, $edited);
+$fp = fopen($file, 'rb');
+var_dump($jp->extract($fp, $index));
+fclose($fp);
+
+unlink($file);
+unlink($index);
+
+/* Only the ranges the paths reach are read: the junk array is not JSON,
+ * and a key that failed to match would fall back to the whole document.
+ * Escaped keys match their decoded form, repeated keys all match. */
+$doc = '{"a\u0062":{"v":1},"junk":[' . str_repeat('@', 100) . '],' .
+    '"dup":{"v":2},"dup":{"v":3},"\ud83d\ude00":{"v":4}}';
+$clean = str_replace(str_repeat('@', 100), '1', $doc);
+file_put_contents($file, $doc);
+var_dump(JsonPath::buildIndex($file, $index));
+
+$seen = array();
+$jp = new JsonPath();
+$jp->addPath('ab.v');
+$jp->addPath('dup.v');
+$jp->addPath("\u{1F600}.v");
+$jp->addCallback(function ($path, $value) use (&$seen) {
+    $seen[] = "$path=$value";
+});
+
+var_dump($jp->parse($doc));
+$seen = array();
+var_dump($jp->parse($clean));
+$expected = $seen;
+var_dump(count($expected));
+
+$seen = array();
+var_dump($jp->parse($doc, $index), $seen === $expected);
+
+$seen = array();
+$fp = fopen($file, 'rb');
+var_dump($jp->parse($fp, $index), $seen === $expected);
+fclose($fp);
+
+unlink($file);
+unlink($index);
+?>
+--EXPECTF--
+bool(true)
+int(100)
+bool(true)
+bool(true)
+
+Warning: JsonPath::extract(): Invalid index file %s in %s on line %d
+bool(false)
+
+Warning: JsonPath::extract(): Invalid index file %s in %s on line %d
+bool(false)
+
+Warning: JsonPath::extract(): Index file %s does not match the input in %s on line %d
+bool(false)
+
+Warning: JsonPath::extract(): Index file %s does not match the input in %s on line %d
+bool(false)
+bool(true)
+
+Warning: JsonPath::parse(): Failed parsing JSON in %s on line %d
+bool(false)
+bool(true)
+int(4)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
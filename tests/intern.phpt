@@ -0,0 +1,61 @@
+--TEST--
+Interned keys and values decode correctly, also once the table is full
+--SKIPIF--
+<?php if (!extension_loaded('json_path')) die('skip json_path not loaded'); ?>
+--FILE--
+<?php
+/* 4000 distinct short keys and values fill the table past its 3/4
+ * cutoff; "late" and "after" are first seen once it no longer grows */
+$rows = array();
+for ($i = 0; $i < 4000; $i++) {
+    $row = array(
+        'type' => $i % 2 ? 'user' : 'group',
+        "k$i" => "v$i",
+        str_repeat('long key ', 4) . $i % 3 => str_repeat('long value ', 4),
+    );
+    if ($i >= 3500) {
+        $row['late'] = 'after';
+    }
+    $rows[] = $row;
+}
+$json = json_encode(array('rows' => $rows, 'tail' => array('k1' => 'v2')));
+$expected = json_decode($json, true);
+
+function run($json, $intern)
+{
+    $jp = new JsonPath();
+    $jp->setObjectsAsArrays(true);
+    $jp->setInternStrings($intern);
+    $jp->addPath('rows');
+    $jp->addPath('rows[*].late');
+    $jp->addPath('tail');
+    return $jp->extract($json);
+}
+
+$jp = new JsonPath();
+var_dump($jp->getInternStrings());
+
+foreach (array(true, false) as $intern) {
+    /* twice, so the second parse starts from a cleared table */
+    for ($i = 0; $i < 2; $i++) {
+        $r = run($json, $intern);
+        var_dump($r['rows'] === $expected['rows'],
+            $r['tail'] === $expected['tail'],
+            $r['rows[*].late'] === array_fill(0, 500, 'after'));
+    }
+}
+?>
+--EXPECT--
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
@@ -0,0 +1,74 @@
+--TEST--
+Parallel parsing of a large top-level array matches serial parsing
+--SKIPIF--
+<?php
+if (!extension_loaded('json_path')) die('skip json_path not loaded');
+$jp = new JsonPath();
+if (!@$jp->setParallelism(2)) die('skip built without threads');
+?>
+--INI--
+memory_limit=512M
+--FILE--
+<?php
+/* separators and brackets inside strings must not split the array */
+$rows = array();
+for ($i = 0; $i < 120000; $i++) {
+    $rows[] = sprintf('{"id":%d,"s":"a,b]}[{\"q\\\\%d","tags":["x%d",%d],' .
+        '"n":{"v":%d.5}}', $i, $i, $i % 7, $i % 3, $i);
+}
+$json = "\n[" . implode(",\n", $rows) . "]\n";
+
+function run($input, $parallelism)
+{
+    $jp = new JsonPath();
+    $jp->setObjectsAsArrays(true);
+    $jp->setParallelism($parallelism);
+    $jp->addPath('[*].id');
+    $jp->addPath('[*].tags[1]');
+    $jp->addPath('[70000]');
+    $jp->aggregate('[*].n.v', JsonPath::AGGREGATE_SUM);
+    $r = $jp->extract($input);
+    if (is_array($r)) {
+        ksort($r);
+    }
+    return $r;
+}
+
+$serial = run($json, 1);
+var_dump(count($serial['[*].id']), $serial['[70000]']['s']);
+var_dump(run($json, 4) === $serial);
+
+/* a file stream is mapped rather than read */
+$file = tempnam(sys_get_temp_dir(), 'jp');
+file_put_contents($file, $json);
+$fp = fopen($file, 'rb');
+var_dump(run($fp, 4) === $serial);
+fclose($fp);
+unlink($file);
+
+/* callbacks see the elements in document order */
+$jp = new JsonPath();
+$jp->setParallelism(4);
+$jp->addPath('[*].id');
+$next = 0;
+$jp->addCallback(function ($path, $id) use (&$next) {
+    if ($id === $next) {
+        $next++;
+    }
+});
+var_dump($jp->parse($json), $next);
+
+/* an error in a later piece fails the whole parse */
+var_dump(run(substr_replace($json, '{"id":', strrpos($json, '{"id":'), 0),
+    4));
+?>
+--EXPECTF--
+int(120000)
+string(15) "a,b]}[{"q\70000"
+bool(true)
+bool(true)
+bool(true)
+int(120000)
+
+Warning: JsonPath::extract(): Failed parsing JSON in %s on line %d
+bool(false)
@@ -0,0 +1,83 @@
+--TEST--
+parseFor() resumes across calls and matches a single parse()
+--SKIPIF--
+<?php if (!extension_loaded('json_path')) die('skip json_path not loaded'); ?>
+--FILE--
+<?php
+$rows = array();
+for ($i = 0; $i < 5000; $i++) {
+    $rows[] = sprintf('{"id":%d,"name":"row %d"}', $i, $i);
+}
+$json = '{"rows":[' . implode(',', $rows) . '],"end":true}';
+
+$seen = array();
+$jp = new JsonPath();
+$jp->addPath('rows[*].id');
+$jp->addPath('end');
+$jp->addCallback(function ($path, $value) use (&$seen) {
+    $seen[] = $path . '=' . json_encode($value);
+});
+
+$jp->parse($json);
+$expected = $seen;
+
+/* a zero budget stops after every slice */
+$seen = array();
+$calls = 0;
+do {
+    $calls++;
+    $status = $jp->parseFor($json, 0);
+} while ($status === JsonPath::PARSE_INCOMPLETE);
+
+var_dump($status === JsonPath::PARSE_COMPLETE, $calls > 1,
+    $seen === $expected);
+
+$fp = fopen('php://memory', 'w+');
+fwrite($fp, $json);
+rewind($fp);
+$seen = array();
+while (($status = $jp->parseFor($fp, 0)) === JsonPath::PARSE_INCOMPLETE);
+var_dump($status === JsonPath::PARSE_COMPLETE, $seen === $expected);
+fclose($fp);
+
+/* paths and options stay fixed until the session ends */
+$seen = array();
+var_dump($jp->parseFor($json, 0) === JsonPath::PARSE_INCOMPLETE);
+var_dump($jp->addPath('rows[0].name'), $jp->setObjectsAsArrays(true));
+while (($status = $jp->parseFor($json, 0)) === JsonPath::PARSE_INCOMPLETE);
+var_dump($status === JsonPath::PARSE_COMPLETE, $seen === $expected,
+    count($jp->getPaths()), $jp->getObjectsAsArrays());
+var_dump($jp->setObjectsAsArrays(false));
+
+/* other input starts over */
+$seen = array();
+var_dump($jp->parseFor($json, 0) === JsonPath::PARSE_INCOMPLETE);
+var_dump($jp->parseFor('{"end":1}', 1000000) === JsonPath::PARSE_COMPLETE);
+var_dump($seen[count($seen) - 1]);
+
+var_dump($jp->parseFor('{"end":', 1000000));
+?>
+--EXPECTF--
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+
+Warning: JsonPath::addPath(): Cannot change a JsonPath while a parseFor() is unfinished in %s on line %d
+
+Warning: JsonPath::setObjectsAsArrays(): Cannot change a JsonPath while a parseFor() is unfinished in %s on line %d
+bool(false)
+bool(false)
+bool(true)
+bool(true)
+int(2)
+bool(false)
+bool(true)
+bool(true)
+bool(true)
+string(5) "end=1"
+
+Warning: JsonPath::parseFor(): Failed parsing JSON in %s on line %d
+bool(false)
@@ -0,0 +1,37 @@
+--TEST--
+parseFor() bounds the output it decompresses per call
+--SKIPIF--
+<?php
+if (!extension_loaded('json_path')) die('skip json_path not loaded');
+if (!function_exists('gzencode')) die('skip zlib extension needed');
+$jp = new JsonPath();
+if (!@$jp->parse(gzencode('[1]'))) die('skip built without gzip support');
+?>
+--FILE--
+<?php
+/* about 2 MB that compresses to a few KB, well under one slice */
+$json = '[' . implode(',', array_fill(0, 200000, '{"a":12345}')) . ']';
+$gz = gzencode($json, 9);
+
+$count = 0;
+$jp = new JsonPath();
+$jp->addPath('[*].a');
+$jp->addCallback(function ($path, $value) use (&$count) {
+    $count++;
+});
+
+$calls = 0;
+do {
+    $calls++;
+    $status = $jp->parseFor($gz, 0);
+} while ($status === JsonPath::PARSE_INCOMPLETE);
+
+var_dump(strlen($gz) < 16384, $status === JsonPath::PARSE_COMPLETE, $count);
+/* at most 64 KB of JSON per call */
+var_dump($calls >= intdiv(strlen($json), 65536));
+?>
+--EXPECT--
+bool(true)
+bool(true)
+int(200000)
+bool(true)
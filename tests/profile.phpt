@@ -0,0 +1,53 @@
+--TEST--
+JsonPath::profile() summarizes types and sizes per normalized path
+--SKIPIF--
+<?php if (!extension_loaded('json_path')) die('skip json_path not loaded'); ?>
+--FILE--
+<?php
+function show($profile)
+{
+    foreach ($profile as $path => $info) {
+        printf("%s %s count=%d types=%s size=%s..%s\n", json_encode($path),
+            gettype($path), $info['count'], implode('|', $info['types']),
+            var_export($info['min_size'], true),
+            var_export($info['max_size'], true));
+    }
+}
+
+$jp = new JsonPath();
+show($jp->profile('{"0":{"a":1},"list":[{"x":1},{"x":"ab"},' .
+    '{"x":null,"y":[1,2,3]}],"s":"hello","e":{},"n":1.5,"b":true}'));
+
+/* object keys used as data stop being tracked past the limit */
+$keys = array();
+for ($i = 0; $i < 10005; $i++) {
+    $keys[] = "\"k$i\":$i";
+}
+$r = $jp->profile('{' . implode(',', $keys) . '}');
+var_dump(count($r), $r['']['max_size'], isset($r['k9998']),
+    isset($r['k9999']));
+
+var_dump($jp->profile('{"a":'));
+?>
+--EXPECTF--
+"" string count=1 types=object size=6..6
+"0" string count=1 types=object size=1..1
+"0.a" string count=1 types=integer size=NULL..NULL
+"list" string count=1 types=array size=3..3
+"list[*]" string count=3 types=object size=1..2
+"list[*].x" string count=3 types=null|integer|string size=2..2
+"list[*].y" string count=1 types=array size=3..3
+"list[*].y[*]" string count=3 types=integer size=NULL..NULL
+"s" string count=1 types=string size=5..5
+"e" string count=1 types=object size=0..0
+"n" string count=1 types=float size=NULL..NULL
+"b" string count=1 types=boolean size=NULL..NULL
+
+Notice: JsonPath::profile(): More than 10000 distinct paths, the rest were not profiled in %s on line %d
+int(10000)
+int(10005)
+bool(true)
+bool(false)
+
+Warning: JsonPath::profile(): Failed parsing JSON in %s on line %d
+bool(false)
@@ -0,0 +1,62 @@
+--TEST--
+Read-ahead gives the same matches as reading the stream in place
+--SKIPIF--
+<?php
+if (!extension_loaded('json_path')) die('skip json_path not loaded');
+$jp = new JsonPath();
+if (!@$jp->setReadAhead(true)) die('skip built without threads');
+?>
+--FILE--
+<?php
+$rows = array();
+for ($i = 0; $i < 50000; $i++) {
+    $rows[] = sprintf('{"id":%d,"name":"user %d","tags":["a","b"]}', $i, $i);
+}
+/* several read-ahead buffers long */
+$json = ' {"rows":[' . implode(',', $rows) . '],"end":true}';
+
+$file = tempnam(sys_get_temp_dir(), 'jp');
+file_put_contents($file, $json);
+
+function run($file, $readAhead, $skip)
+{
+    $jp = new JsonPath();
+    $jp->addPath('rows[*].id');
+    $jp->addPath('end');
+    $jp->setReadAhead($readAhead);
+
+    $fp = fopen($file, 'rb');
+    /* leaves the rest of PHP's read buffer for read-ahead to drain first */
+    if ($skip) {
+        fread($fp, 1);
+    }
+    $r = $jp->extract($fp);
+    fclose($fp);
+
+    return $r;
+}
+
+$plain = run($file, false, false);
+var_dump(count($plain['rows[*].id']), $plain['end']);
+
+var_dump(run($file, true, false) === $plain);
+var_dump(run($file, true, true) === $plain);
+
+$jp = new JsonPath();
+$jp->addPath('end');
+$jp->setReadAhead(true);
+file_put_contents($file, substr($json, 0, -1));
+$fp = fopen($file, 'rb');
+var_dump($jp->extract($fp));
+fclose($fp);
+
+unlink($file);
+?>
+--EXPECTF--
+int(50000)
+bool(true)
+bool(true)
+bool(true)
+
+Warning: JsonPath::extract(): Failed parsing JSON in %s on line %d
+bool(false)
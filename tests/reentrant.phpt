@@ -0,0 +1,26 @@
+--TEST--
+A JsonPath cannot be reused from its own callbacks while it parses
+--SKIPIF--
+<?php if (!extension_loaded('json_path')) die('skip json_path not loaded'); ?>
+--FILE--
+<?php
+$jp = new JsonPath();
+$jp->addPath('a');
+$jp->addCallback(function ($path, $value) use ($jp) {
+    var_dump($jp->parse('{"a":2}'));
+    var_dump($jp->addPath('b'));
+    echo "a = $value\n";
+});
+
+var_dump($jp->parse('{"a":1}'));
+var_dump(count($jp->getPaths()));
+?>
+--EXPECTF--
+Warning: JsonPath::parse(): Cannot use a JsonPath from its own callbacks while it parses in %s on line %d
+bool(false)
+
+Warning: JsonPath::addPath(): Cannot use a JsonPath from its own callbacks while it parses in %s on line %d
+bool(false)
+a = 1
+bool(true)
+int(1)
@@ -0,0 +1,43 @@
+--TEST--
+A failed parse does not leak state into the next parse or profile
+--SKIPIF--
+<?php if (!extension_loaded('json_path')) die('skip json_path not loaded'); ?>
+--FILE--
+<?php
+$jp = new JsonPath();
+$jp->addPath('a.b');
+
+/* leaves two containers open */
+var_dump($jp->extract('{"a":{"b":'));
+echo json_encode($jp->extract('{"a":{"b":1}}')), "\n";
+var_dump($jp->extract('{"a":{"b":1}} {"a":{"b":2}}'));
+
+var_dump($jp->extract('{"a":{"b":'));
+var_dump($jp->profile('1 2'));
+echo json_encode($jp->profile('{"a":[1,"xy"]}')), "\n";
+
+var_dump($jp->profile('[1,'));
+var_dump($jp->profile(''));
+echo json_encode($jp->extract('{"a":{"b":[true]}}')), "\n";
+?>
+--EXPECTF--
+Warning: JsonPath::extract(): Failed parsing JSON in %s on line %d
+bool(false)
+{"a.b":1}
+
+Warning: JsonPath::extract(): Failed parsing JSON in %s on line %d
+bool(false)
+
+Warning: JsonPath::extract(): Failed parsing JSON in %s on line %d
+bool(false)
+
+Warning: JsonPath::profile(): Failed parsing JSON in %s on line %d
+bool(false)
+{"":{"count":1,"types":["object"],"min_size":1,"max_size":1},"a":{"count":1,"types":["array"],"min_size":2,"max_size":2},"a[*]":{"count":2,"types":["integer","string"],"min_size":2,"max_size":2}}
+
+Warning: JsonPath::profile(): Failed parsing JSON in %s on line %d
+bool(false)
+
+Warning: JsonPath::profile(): Failed parsing JSON in %s on line %d
+bool(false)
+{"a.b":[true]}
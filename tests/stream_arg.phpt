@@ -0,0 +1,54 @@
+--TEST--
+A resource that is not a stream is rejected like other stream functions do
+--SKIPIF--
+<?php if (!extension_loaded('json_path')) die('skip json_path not loaded'); ?>
+--FILE--
+<?php
+/* PHP 7 warns, PHP 8 throws; both carry the same message */
+set_error_handler(function ($no, $message) {
+    echo $message, "\n";
+    return true;
+});
+
+function attempt($fn)
+{
+    try {
+        $fn();
+    } catch (TypeError $e) {
+        echo $e->getMessage(), "\n";
+    }
+}
+
+$context = stream_context_create();
+$closed = fopen('php://memory', 'r');
+fclose($closed);
+$out = fopen('php://memory', 'w');
+
+$jp = new JsonPath();
+$jp->addPath('a');
+
+attempt(function () use ($jp, $context) { $jp->parse($context); });
+attempt(function () use ($jp, $closed) { $jp->extract($closed); });
+attempt(function () use ($jp, $context) { $jp->parseFor($context, 1000); });
+attempt(function () use ($context) { JsonPath::tape($context); });
+attempt(function () use ($jp, $context) {
+    $jp->transform('{"a":1}', $context, JsonPath::TRANSFORM_REMOVE);
+});
+attempt(function () use ($jp, $context, $out) {
+    $jp->transform($context, $out, JsonPath::TRANSFORM_REMOVE);
+});
+
+/* the object is still usable */
+var_dump($jp->extract('{"a":1}'));
+?>
+--EXPECT--
+JsonPath::parse(): supplied resource is not a valid stream resource
+JsonPath::extract(): supplied resource is not a valid stream resource
+JsonPath::parseFor(): supplied resource is not a valid stream resource
+JsonPath::tape(): supplied resource is not a valid stream resource
+JsonPath::transform(): supplied resource is not a valid stream resource
+JsonPath::transform(): supplied resource is not a valid stream resource
+array(1) {
+  ["a"]=>
+  int(1)
+}
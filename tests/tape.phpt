@@ -0,0 +1,83 @@
+--TEST--
+A tape replays to the same matches as the JSON it was built from
+--SKIPIF--
+<?php if (!extension_loaded('json_path')) die('skip json_path not loaded'); ?>
+--FILE--
+<?php
+$json = '{"id":9007199254740993,"f":-1.25e3,"s":"a\"b\\\\cé😀",' .
+    '"skip":{"deep":[[1,2],{"x":null}]},"items":[{"k":true,"v":[1,{}]},' .
+    '{"k":false,"v":[]}],"":"empty","last":[]}';
+
+function extract_all($input, $paths)
+{
+    $jp = new JsonPath();
+    $jp->setObjectsAsArrays(true);
+    foreach ($paths as $path) {
+        $jp->addPath($path);
+    }
+    return $jp->extract($input);
+}
+
+$tape = JsonPath::tape($json);
+var_dump(substr($tape, 0, 4) === "\0JPT");
+
+$sets = array(
+    array('id', 'f', 's'),
+    array('items[*].k', 'items[1]', 'last'),
+    array('skip', 'items', 'items[0].v[1]'),
+    array('missing', 'items[*].missing'),
+);
+foreach ($sets as $paths) {
+    var_dump(extract_all($tape, $paths) === extract_all($json, $paths));
+}
+
+/* callbacks fire in the same order */
+$order = array();
+foreach (array($json, $tape) as $input) {
+    $jp = new JsonPath();
+    $jp->addPath('items[*]');
+    $jp->addPath('items[*].v');
+    $jp->addPath('last');
+    $seen = '';
+    $jp->addCallback(function ($path, $value) use (&$seen) {
+        $seen .= $path . ';';
+    });
+    $jp->parse($input);
+    $order[] = $seen;
+}
+var_dump($order[0] !== '' && $order[0] === $order[1]);
+
+/* a tape built from a stream */
+$fp = fopen('php://memory', 'w+');
+fwrite($fp, $json);
+rewind($fp);
+var_dump(JsonPath::tape($fp) === $tape);
+fclose($fp);
+
+$jp = new JsonPath();
+$jp->addPath('id');
+var_dump($jp->extract($tape, __FILE__));
+var_dump($jp->extract(substr_replace($tape, "\x09", 4, 1)));
+var_dump($jp->extract(substr($tape, 0, -3)));
+var_dump(JsonPath::tape('{"a":'));
+?>
+--EXPECTF--
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+
+Warning: JsonPath::extract(): A tape cannot be used with an index or transformed in %s on line %d
+bool(false)
+
+Warning: JsonPath::extract(): Unsupported tape version in %s on line %d
+bool(false)
+
+Warning: JsonPath::extract(): %s in %s on line %d
+bool(false)
+
+Warning: JsonPath::tape(): Failed parsing JSON in %s on line %d
+bool(false)
@@ -0,0 +1,56 @@
+--TEST--
+transform() removes or replaces matched nodes and copies the rest
+--SKIPIF--
+<?php if (!extension_loaded('json_path')) die('skip json_path not loaded'); ?>
+--FILE--
+<?php
+function transform($json, $paths, $mode, $replacement = null)
+{
+    $jp = new JsonPath();
+    foreach ($paths as $path) {
+        $jp->addPath($path);
+    }
+
+    $out = fopen('php://memory', 'w+');
+    $ok = $jp->transform($json, $out, $mode, $replacement);
+    rewind($out);
+    echo $ok ? stream_get_contents($out) : 'failed', "\n";
+    fclose($out);
+}
+
+$json = '{"a":1,"b":{"c":[1,2],"e":0},"d":3}';
+
+transform($json, array('b'), JsonPath::TRANSFORM_REMOVE);
+transform($json, array('a'), JsonPath::TRANSFORM_REMOVE);
+transform($json, array('b.c'), JsonPath::TRANSFORM_REMOVE);
+transform($json, array('a', 'd'), JsonPath::TRANSFORM_REMOVE);
+transform('{"a": 1, "b": 2}', array('b'), JsonPath::TRANSFORM_REMOVE);
+
+transform($json, array('b'), JsonPath::TRANSFORM_REPLACE, 'x/é');
+transform($json, array('b.c', 'd'), JsonPath::TRANSFORM_REPLACE,
+    array('x' => null));
+
+transform($json, array('b'), JsonPath::TRANSFORM_CALLBACK,
+    function ($path, $value) {
+        return $path . ':' . count($value->c);
+    });
+
+/* nothing matched: the input is copied as is */
+transform(" [1, {\"a\" : 2}]\n", array('z'), JsonPath::TRANSFORM_REMOVE);
+
+var_dump((new JsonPath())->transform($json, fopen('php://memory', 'w'), 9));
+?>
+--EXPECTF--
+{"a":1,"d":3}
+{"b":{"c":[1,2],"e":0},"d":3}
+{"a":1,"b":{"e":0},"d":3}
+{"b":{"c":[1,2],"e":0}}
+{"a": 1}
+{"a":1,"b":"x/é","d":3}
+{"a":1,"b":{"c":{"x":null},"e":0},"d":{"x":null}}
+{"a":1,"b":"b:2","d":3}
+ [1, {"a" : 2}]
+
+
+Warning: JsonPath::transform(): Unknown transform mode in %s on line %d
+bool(false)